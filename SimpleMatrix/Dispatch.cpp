@@ -0,0 +1,628 @@
+#include "Dispatch.h"
+
+#include <atomic>
+#include <cstdlib>
+#include <cstring>
+#include <string>
+
+#if defined(_M_X64) || defined(_M_IX86) || defined(__x86_64__) || defined(__i386__)
+#define SM_X86 1
+#include <immintrin.h>
+#if defined(_MSC_VER)
+#include <intrin.h>
+#else
+#include <cpuid.h>
+#endif
+// MSVC got AVX-512 intrinsics in VS2017 15.3 and VNNI ones in VS2019,
+// older toolsets stop at the AVX2 level
+#if !defined(_MSC_VER) || defined(__clang__) || _MSC_VER >= 1911
+#define SM_AVX512 1
+#endif
+#if !defined(_MSC_VER) || defined(__clang__) || _MSC_VER >= 1920
+#define SM_AVX512_VNNI 1
+#endif
+#endif
+
+namespace sm {
+  namespace dispatch {
+
+    namespace generic {
+      int32_t dot_int8(const int8_t* a, const int8_t* b, size_t size) {
+        int32_t result = 0;
+        for (size_t pos = 0; pos < size; pos++)
+          result += static_cast<int32_t>(a[pos]) * static_cast<int32_t>(b[pos]);
+        return result;
+      }
+
+      void bf16_to_float(const uint16_t* src, float* dst, size_t size) {
+        for (size_t pos = 0; pos < size; pos++) {
+          const uint32_t f = static_cast<uint32_t>(src[pos]) << 16;
+          std::memcpy(dst + pos, &f, sizeof(float));
+        }
+      }
+
+      void fp16_to_float(const uint16_t* src, float* dst, size_t size) {
+        for (size_t pos = 0; pos < size; pos++)
+          dst[pos] = half_to_float(src[pos]);
+      }
+    }
+
+#ifdef SM_X86
+    namespace sse2 {
+      struct FloatVec {
+        typedef float scalar;
+        typedef __m128 reg;
+        static const size_t width = 4;
+        static reg zero() { return _mm_setzero_ps(); }
+        static reg set1(float value) { return _mm_set1_ps(value); }
+        static reg load(const float* p) { return _mm_loadu_ps(p); }
+        static void store(float* p, reg r) { _mm_storeu_ps(p, r); }
+        static reg add(reg a, reg b) { return _mm_add_ps(a, b); }
+        static reg sub(reg a, reg b) { return _mm_sub_ps(a, b); }
+        static reg mul(reg a, reg b) { return _mm_mul_ps(a, b); }
+        static reg fmadd(reg a, reg b, reg c) { return _mm_add_ps(_mm_mul_ps(a, b), c); }
+        static reg abs(reg a) { return _mm_andnot_ps(_mm_set1_ps(-0.f), a); }
+        static reg max(reg a, reg b) { return _mm_max_ps(a, b); }
+        static bool any_equal(reg a, reg b) { return _mm_movemask_ps(_mm_cmpeq_ps(a, b)) != 0; }
+        static float hsum(reg a) {
+          a = _mm_add_ps(a, _mm_movehl_ps(a, a));
+          a = _mm_add_ss(a, _mm_shuffle_ps(a, a, 1));
+          return _mm_cvtss_f32(a);
+        }
+        static float hmax(reg a) {
+          a = _mm_max_ps(a, _mm_movehl_ps(a, a));
+          a = _mm_max_ss(a, _mm_shuffle_ps(a, a, 1));
+          return _mm_cvtss_f32(a);
+        }
+        static void transpose_block(const float* src, size_t src_stride, float* dst, size_t dst_stride) {
+          reg r0 = load(src), r1 = load(src + src_stride);
+          reg r2 = load(src + 2 * src_stride), r3 = load(src + 3 * src_stride);
+          _MM_TRANSPOSE4_PS(r0, r1, r2, r3);
+          store(dst, r0);
+          store(dst + dst_stride, r1);
+          store(dst + 2 * dst_stride, r2);
+          store(dst + 3 * dst_stride, r3);
+        }
+      };
+
+      struct DoubleVec {
+        typedef double scalar;
+        typedef __m128d reg;
+        static const size_t width = 2;
+        static reg zero() { return _mm_setzero_pd(); }
+        static reg set1(double value) { return _mm_set1_pd(value); }
+        static reg load(const double* p) { return _mm_loadu_pd(p); }
+        static void store(double* p, reg r) { _mm_storeu_pd(p, r); }
+        static reg add(reg a, reg b) { return _mm_add_pd(a, b); }
+        static reg sub(reg a, reg b) { return _mm_sub_pd(a, b); }
+        static reg mul(reg a, reg b) { return _mm_mul_pd(a, b); }
+        static reg fmadd(reg a, reg b, reg c) { return _mm_add_pd(_mm_mul_pd(a, b), c); }
+        static reg abs(reg a) { return _mm_andnot_pd(_mm_set1_pd(-0.), a); }
+        static reg max(reg a, reg b) { return _mm_max_pd(a, b); }
+        static bool any_equal(reg a, reg b) { return _mm_movemask_pd(_mm_cmpeq_pd(a, b)) != 0; }
+        static double hsum(reg a) { return _mm_cvtsd_f64(_mm_add_sd(a, _mm_unpackhi_pd(a, a))); }
+        static double hmax(reg a) { return _mm_cvtsd_f64(_mm_max_sd(a, _mm_unpackhi_pd(a, a))); }
+        static void transpose_block(const double* src, size_t src_stride, double* dst, size_t dst_stride) {
+          const reg r0 = load(src), r1 = load(src + src_stride);
+          store(dst, _mm_unpacklo_pd(r0, r1));
+          store(dst + dst_stride, _mm_unpackhi_pd(r0, r1));
+        }
+      };
+
+#include "Kernels.inl"
+
+      // bf16 bits are the upper half of float bits
+      void bf16_to_float(const uint16_t* src, float* dst, size_t size) {
+        size_t pos = 0;
+        const __m128i zero = _mm_setzero_si128();
+        for (; pos + 8 <= size; pos += 8) {
+          __m128i v = _mm_loadu_si128(reinterpret_cast<const __m128i*>(src + pos));
+          _mm_storeu_ps(dst + pos, _mm_castsi128_ps(_mm_unpacklo_epi16(zero, v)));
+          _mm_storeu_ps(dst + pos + 4, _mm_castsi128_ps(_mm_unpackhi_epi16(zero, v)));
+        }
+        generic::bf16_to_float(src + pos, dst + pos, size - pos);
+      }
+    }
+
+    // Every function of the level sections below is compiled for its
+    // instruction set, MSVC doesn't need it to emit the intrinsics
+#if defined(__clang__)
+#pragma clang attribute push (__attribute__((target("avx2,fma,f16c"))), apply_to = function)
+#elif defined(__GNUC__)
+#pragma GCC push_options
+#pragma GCC target("avx2,fma,f16c")
+#endif
+    namespace avx2 {
+      struct FloatVec {
+        typedef float scalar;
+        typedef __m256 reg;
+        static const size_t width = 8;
+        static reg zero() { return _mm256_setzero_ps(); }
+        static reg set1(float value) { return _mm256_set1_ps(value); }
+        static reg load(const float* p) { return _mm256_loadu_ps(p); }
+        static void store(float* p, reg r) { _mm256_storeu_ps(p, r); }
+        static reg add(reg a, reg b) { return _mm256_add_ps(a, b); }
+        static reg sub(reg a, reg b) { return _mm256_sub_ps(a, b); }
+        static reg mul(reg a, reg b) { return _mm256_mul_ps(a, b); }
+        static reg fmadd(reg a, reg b, reg c) { return _mm256_fmadd_ps(a, b, c); }
+        static reg abs(reg a) { return _mm256_andnot_ps(_mm256_set1_ps(-0.f), a); }
+        static reg max(reg a, reg b) { return _mm256_max_ps(a, b); }
+        static bool any_equal(reg a, reg b) { return _mm256_movemask_ps(_mm256_cmp_ps(a, b, _CMP_EQ_OQ)) != 0; }
+        static float hsum(reg a) {
+          return sse2::FloatVec::hsum(_mm_add_ps(_mm256_castps256_ps128(a), _mm256_extractf128_ps(a, 1)));
+        }
+        static float hmax(reg a) {
+          return sse2::FloatVec::hmax(_mm_max_ps(_mm256_castps256_ps128(a), _mm256_extractf128_ps(a, 1)));
+        }
+        // 4 * 4 transposes inside 128-bit lanes, then lanes are exchanged
+        static void transpose_block(const float* src, size_t src_stride, float* dst, size_t dst_stride) {
+          reg r[8], t[8];
+          for (size_t i = 0; i < 8; i++)
+            r[i] = load(src + i * src_stride);
+          for (size_t i = 0; i < 8; i += 2) {
+            t[i] = _mm256_unpacklo_ps(r[i], r[i + 1]);
+            t[i + 1] = _mm256_unpackhi_ps(r[i], r[i + 1]);
+          }
+          for (size_t i = 0; i < 8; i += 4) {
+            r[i] = _mm256_castpd_ps(_mm256_unpacklo_pd(_mm256_castps_pd(t[i]), _mm256_castps_pd(t[i + 2])));
+            r[i + 1] = _mm256_castpd_ps(_mm256_unpackhi_pd(_mm256_castps_pd(t[i]), _mm256_castps_pd(t[i + 2])));
+            r[i + 2] = _mm256_castpd_ps(_mm256_unpacklo_pd(_mm256_castps_pd(t[i + 1]), _mm256_castps_pd(t[i + 3])));
+            r[i + 3] = _mm256_castpd_ps(_mm256_unpackhi_pd(_mm256_castps_pd(t[i + 1]), _mm256_castps_pd(t[i + 3])));
+          }
+          for (size_t i = 0; i < 4; i++) {
+            store(dst + i * dst_stride, _mm256_permute2f128_ps(r[i], r[i + 4], 0x20));
+            store(dst + (i + 4) * dst_stride, _mm256_permute2f128_ps(r[i], r[i + 4], 0x31));
+          }
+        }
+      };
+
+      struct DoubleVec {
+        typedef double scalar;
+        typedef __m256d reg;
+        static const size_t width = 4;
+        static reg zero() { return _mm256_setzero_pd(); }
+        static reg set1(double value) { return _mm256_set1_pd(value); }
+        static reg load(const double* p) { return _mm256_loadu_pd(p); }
+        static void store(double* p, reg r) { _mm256_storeu_pd(p, r); }
+        static reg add(reg a, reg b) { return _mm256_add_pd(a, b); }
+        static reg sub(reg a, reg b) { return _mm256_sub_pd(a, b); }
+        static reg mul(reg a, reg b) { return _mm256_mul_pd(a, b); }
+        static reg fmadd(reg a, reg b, reg c) { return _mm256_fmadd_pd(a, b, c); }
+        static reg abs(reg a) { return _mm256_andnot_pd(_mm256_set1_pd(-0.), a); }
+        static reg max(reg a, reg b) { return _mm256_max_pd(a, b); }
+        static bool any_equal(reg a, reg b) { return _mm256_movemask_pd(_mm256_cmp_pd(a, b, _CMP_EQ_OQ)) != 0; }
+        static double hsum(reg a) {
+          return sse2::DoubleVec::hsum(_mm_add_pd(_mm256_castpd256_pd128(a), _mm256_extractf128_pd(a, 1)));
+        }
+        static double hmax(reg a) {
+          return sse2::DoubleVec::hmax(_mm_max_pd(_mm256_castpd256_pd128(a), _mm256_extractf128_pd(a, 1)));
+        }
+        static void transpose_block(const double* src, size_t src_stride, double* dst, size_t dst_stride) {
+          const reg r0 = load(src), r1 = load(src + src_stride);
+          const reg r2 = load(src + 2 * src_stride), r3 = load(src + 3 * src_stride);
+          const reg t0 = _mm256_unpacklo_pd(r0, r1), t1 = _mm256_unpackhi_pd(r0, r1);
+          const reg t2 = _mm256_unpacklo_pd(r2, r3), t3 = _mm256_unpackhi_pd(r2, r3);
+          store(dst, _mm256_permute2f128_pd(t0, t2, 0x20));
+          store(dst + dst_stride, _mm256_permute2f128_pd(t1, t3, 0x20));
+          store(dst + 2 * dst_stride, _mm256_permute2f128_pd(t0, t2, 0x31));
+          store(dst + 3 * dst_stride, _mm256_permute2f128_pd(t1, t3, 0x31));
+        }
+      };
+
+#include "Kernels.inl"
+
+      // pmaddubsw multiplies unsigned by signed bytes: use |a| and b * sign(a)
+      int32_t dot_int8(const int8_t* a, const int8_t* b, size_t size) {
+        size_t pos = 0;
+        __m256i acc = _mm256_setzero_si256();
+        const __m256i ones = _mm256_set1_epi16(1);
+        for (; pos + 32 <= size; pos += 32) {
+          __m256i va = _mm256_loadu_si256(reinterpret_cast<const __m256i*>(a + pos));
+          __m256i vb = _mm256_loadu_si256(reinterpret_cast<const __m256i*>(b + pos));
+          __m256i products = _mm256_maddubs_epi16(_mm256_abs_epi8(va), _mm256_sign_epi8(vb, va));
+          acc = _mm256_add_epi32(acc, _mm256_madd_epi16(products, ones));
+        }
+        __m128i acc128 = _mm_add_epi32(_mm256_castsi256_si128(acc), _mm256_extracti128_si256(acc, 1));
+        acc128 = _mm_add_epi32(acc128, _mm_shuffle_epi32(acc128, 0x4e));
+        acc128 = _mm_add_epi32(acc128, _mm_shuffle_epi32(acc128, 0xb1));
+        return _mm_cvtsi128_si32(acc128) + generic::dot_int8(a + pos, b + pos, size - pos);
+      }
+
+      void bf16_to_float(const uint16_t* src, float* dst, size_t size) {
+        size_t pos = 0;
+        for (; pos + 8 <= size; pos += 8) {
+          __m256i v = _mm256_cvtepu16_epi32(_mm_loadu_si128(reinterpret_cast<const __m128i*>(src + pos)));
+          _mm256_storeu_ps(dst + pos, _mm256_castsi256_ps(_mm256_slli_epi32(v, 16)));
+        }
+        generic::bf16_to_float(src + pos, dst + pos, size - pos);
+      }
+
+      // F16C conversion, exact for every half value
+      void fp16_to_float(const uint16_t* src, float* dst, size_t size) {
+        size_t pos = 0;
+        for (; pos + 8 <= size; pos += 8)
+          _mm256_storeu_ps(dst + pos, _mm256_cvtph_ps(_mm_loadu_si128(reinterpret_cast<const __m128i*>(src + pos))));
+        generic::fp16_to_float(src + pos, dst + pos, size - pos);
+      }
+    }
+#if defined(__clang__)
+#pragma clang attribute pop
+#elif defined(__GNUC__)
+#pragma GCC pop_options
+#endif
+
+#ifdef SM_AVX512
+#if defined(__clang__)
+#pragma clang attribute push (__attribute__((target("avx512f,avx2,fma,f16c"))), apply_to = function)
+#elif defined(__GNUC__)
+#pragma GCC push_options
+#pragma GCC target("avx512f,avx2,fma,f16c")
+// GCC 12 headers read an uninitialized variable in _mm512_undefined_*
+#pragma GCC diagnostic push
+#pragma GCC diagnostic ignored "-Wuninitialized"
+#pragma GCC diagnostic ignored "-Wmaybe-uninitialized"
+#endif
+    namespace avx512 {
+      struct FloatVec {
+        typedef float scalar;
+        typedef __m512 reg;
+        static const size_t width = 16;
+        static reg zero() { return _mm512_setzero_ps(); }
+        static reg set1(float value) { return _mm512_set1_ps(value); }
+        static reg load(const float* p) { return _mm512_loadu_ps(p); }
+        static void store(float* p, reg r) { _mm512_storeu_ps(p, r); }
+        static reg add(reg a, reg b) { return _mm512_add_ps(a, b); }
+        static reg sub(reg a, reg b) { return _mm512_sub_ps(a, b); }
+        static reg mul(reg a, reg b) { return _mm512_mul_ps(a, b); }
+        static reg fmadd(reg a, reg b, reg c) { return _mm512_fmadd_ps(a, b, c); }
+        static reg abs(reg a) { return _mm512_abs_ps(a); }
+        static reg max(reg a, reg b) { return _mm512_max_ps(a, b); }
+        static bool any_equal(reg a, reg b) { return _mm512_cmp_ps_mask(a, b, _CMP_EQ_OQ) != 0; }
+        static float hsum(reg a) { return _mm512_reduce_add_ps(a); }
+        static float hmax(reg a) { return _mm512_reduce_max_ps(a); }
+        // 4 * 4 transposes inside 128-bit lanes, then lanes are gathered
+        // by two rounds of lane shuffles
+        static void transpose_block(const float* src, size_t src_stride, float* dst, size_t dst_stride) {
+          reg r[16], t[16];
+          for (size_t i = 0; i < 16; i++)
+            r[i] = load(src + i * src_stride);
+          for (size_t i = 0; i < 16; i += 2) {
+            t[i] = _mm512_unpacklo_ps(r[i], r[i + 1]);
+            t[i + 1] = _mm512_unpackhi_ps(r[i], r[i + 1]);
+          }
+          for (size_t i = 0; i < 16; i += 4) {
+            r[i] = _mm512_castpd_ps(_mm512_unpacklo_pd(_mm512_castps_pd(t[i]), _mm512_castps_pd(t[i + 2])));
+            r[i + 1] = _mm512_castpd_ps(_mm512_unpackhi_pd(_mm512_castps_pd(t[i]), _mm512_castps_pd(t[i + 2])));
+            r[i + 2] = _mm512_castpd_ps(_mm512_unpacklo_pd(_mm512_castps_pd(t[i + 1]), _mm512_castps_pd(t[i + 3])));
+            r[i + 3] = _mm512_castpd_ps(_mm512_unpackhi_pd(_mm512_castps_pd(t[i + 1]), _mm512_castps_pd(t[i + 3])));
+          }
+          // Lane l of r[4 * g + j] is column 4 * l + j of rows 4 * g .. 4 * g + 3
+          for (size_t j = 0; j < 4; j++) {
+            const reg even1 = _mm512_shuffle_f32x4(r[j], r[4 + j], 0x88);
+            const reg odd1 = _mm512_shuffle_f32x4(r[j], r[4 + j], 0xdd);
+            const reg even2 = _mm512_shuffle_f32x4(r[8 + j], r[12 + j], 0x88);
+            const reg odd2 = _mm512_shuffle_f32x4(r[8 + j], r[12 + j], 0xdd);
+            store(dst + j * dst_stride, _mm512_shuffle_f32x4(even1, even2, 0x88));
+            store(dst + (4 + j) * dst_stride, _mm512_shuffle_f32x4(odd1, odd2, 0x88));
+            store(dst + (8 + j) * dst_stride, _mm512_shuffle_f32x4(even1, even2, 0xdd));
+            store(dst + (12 + j) * dst_stride, _mm512_shuffle_f32x4(odd1, odd2, 0xdd));
+          }
+        }
+      };
+
+      struct DoubleVec {
+        typedef double scalar;
+        typedef __m512d reg;
+        static const size_t width = 8;
+        static reg zero() { return _mm512_setzero_pd(); }
+        static reg set1(double value) { return _mm512_set1_pd(value); }
+        static reg load(const double* p) { return _mm512_loadu_pd(p); }
+        static void store(double* p, reg r) { _mm512_storeu_pd(p, r); }
+        static reg add(reg a, reg b) { return _mm512_add_pd(a, b); }
+        static reg sub(reg a, reg b) { return _mm512_sub_pd(a, b); }
+        static reg mul(reg a, reg b) { return _mm512_mul_pd(a, b); }
+        static reg fmadd(reg a, reg b, reg c) { return _mm512_fmadd_pd(a, b, c); }
+        static reg abs(reg a) { return _mm512_abs_pd(a); }
+        static reg max(reg a, reg b) { return _mm512_max_pd(a, b); }
+        static bool any_equal(reg a, reg b) { return _mm512_cmp_pd_mask(a, b, _CMP_EQ_OQ) != 0; }
+        static double hsum(reg a) { return _mm512_reduce_add_pd(a); }
+        static double hmax(reg a) { return _mm512_reduce_max_pd(a); }
+        static void transpose_block(const double* src, size_t src_stride, double* dst, size_t dst_stride) {
+          reg r[8], t[8];
+          for (size_t i = 0; i < 8; i++)
+            r[i] = load(src + i * src_stride);
+          // Lane l of t[2 * g] is column 2 * l, of t[2 * g + 1] column
+          // 2 * l + 1, both of rows 2 * g and 2 * g + 1
+          for (size_t i = 0; i < 8; i += 2) {
+            t[i] = _mm512_unpacklo_pd(r[i], r[i + 1]);
+            t[i + 1] = _mm512_unpackhi_pd(r[i], r[i + 1]);
+          }
+          for (size_t j = 0; j < 2; j++) {
+            const reg even1 = _mm512_shuffle_f64x2(t[j], t[2 + j], 0x88);
+            const reg odd1 = _mm512_shuffle_f64x2(t[j], t[2 + j], 0xdd);
+            const reg even2 = _mm512_shuffle_f64x2(t[4 + j], t[6 + j], 0x88);
+            const reg odd2 = _mm512_shuffle_f64x2(t[4 + j], t[6 + j], 0xdd);
+            store(dst + j * dst_stride, _mm512_shuffle_f64x2(even1, even2, 0x88));
+            store(dst + (2 + j) * dst_stride, _mm512_shuffle_f64x2(odd1, odd2, 0x88));
+            store(dst + (4 + j) * dst_stride, _mm512_shuffle_f64x2(even1, even2, 0xdd));
+            store(dst + (6 + j) * dst_stride, _mm512_shuffle_f64x2(odd1, odd2, 0xdd));
+          }
+        }
+      };
+
+#include "Kernels.inl"
+    }
+#if defined(__clang__)
+#pragma clang attribute pop
+#elif defined(__GNUC__)
+#pragma GCC diagnostic pop
+#pragma GCC pop_options
+#endif
+#endif
+
+#ifdef SM_AVX512_VNNI
+#if defined(__clang__)
+#pragma clang attribute push (__attribute__((target("avx512f,avx512bw,avx512vnni,avx2"))), apply_to = function)
+#elif defined(__GNUC__)
+#pragma GCC push_options
+#pragma GCC target("avx512f,avx512bw,avx512vnni,avx2")
+// GCC 12 headers read an uninitialized variable in _mm512_undefined_*
+#pragma GCC diagnostic push
+#pragma GCC diagnostic ignored "-Wuninitialized"
+#pragma GCC diagnostic ignored "-Wmaybe-uninitialized"
+#endif
+    namespace avx512_vnni {
+      // vpdpbusd multiplies unsigned by signed bytes: use |a| and b * sign(a)
+      int32_t dot_int8(const int8_t* a, const int8_t* b, size_t size) {
+        size_t pos = 0;
+        __m512i acc = _mm512_setzero_si512();
+        for (; pos + 64 <= size; pos += 64) {
+          __m512i va = _mm512_loadu_si512(a + pos);
+          __m512i vb = _mm512_loadu_si512(b + pos);
+          __mmask64 negative = _mm512_movepi8_mask(va);
+          __m512i vb_signed = _mm512_mask_sub_epi8(vb, negative, _mm512_setzero_si512(), vb);
+          acc = _mm512_dpbusd_epi32(acc, _mm512_abs_epi8(va), vb_signed);
+        }
+        return _mm512_reduce_add_epi32(acc) + avx2::dot_int8(a + pos, b + pos, size - pos);
+      }
+    }
+#if defined(__clang__)
+#pragma clang attribute pop
+#elif defined(__GNUC__)
+#pragma GCC diagnostic pop
+#pragma GCC pop_options
+#endif
+#endif
+
+    namespace {
+      void cpuid(unsigned leaf, unsigned subleaf, unsigned regs[4]) {
+#if defined(_MSC_VER)
+        int info[4];
+        __cpuidex(info, static_cast<int>(leaf), static_cast<int>(subleaf));
+        for (int i = 0; i < 4; i++)
+          regs[i] = static_cast<unsigned>(info[i]);
+#else
+        if (leaf > __get_cpuid_max(leaf & 0x80000000u, nullptr)) {
+          regs[0] = regs[1] = regs[2] = regs[3] = 0;
+          return;
+        }
+        __cpuid_count(leaf, subleaf, regs[0], regs[1], regs[2], regs[3]);
+#endif
+      }
+
+      // Register state enabled by OS for XSAVE
+      unsigned long long xcr0() {
+#if defined(_MSC_VER)
+        return _xgetbv(0);
+#else
+        unsigned eax, edx;
+        __asm__("xgetbv" : "=a"(eax), "=d"(edx) : "c"(0));
+        return (static_cast<unsigned long long>(edx) << 32) | eax;
+#endif
+      }
+    }
+#endif
+
+    namespace {
+      Isa detect_isa() {
+#ifdef SM_X86
+        unsigned regs[4];
+        cpuid(0, 0, regs);
+        const unsigned max_leaf = regs[0];
+        cpuid(1, 0, regs);
+        const bool sse2 = (regs[3] >> 26) & 1;
+        const bool osxsave = (regs[2] >> 27) & 1;
+        const bool avx = (regs[2] >> 28) & 1;
+        const bool fma = (regs[2] >> 12) & 1;
+        const bool f16c = (regs[2] >> 29) & 1;
+        bool avx2 = false, avx512 = false;
+        if (max_leaf >= 7) {
+          cpuid(7, 0, regs);
+          avx2 = (regs[1] >> 5) & 1;
+          avx512 = (regs[1] >> 16) & 1;
+        }
+        const unsigned long long xcr = osxsave ? xcr0() : 0;
+        // XMM and YMM state, then opmask and ZMM state
+        const bool os_avx = (xcr & 0x6) == 0x6;
+        const bool os_avx512 = (xcr & 0xe6) == 0xe6;
+
+#ifdef SM_AVX512
+        if (avx512 && avx2 && fma && f16c && avx && os_avx512)
+          return Isa::avx512;
+#else
+        (void)avx512;
+        (void)os_avx512;
+#endif
+        if (avx2 && fma && f16c && avx && os_avx)
+          return Isa::avx2;
+        if (sse2)
+          return Isa::sse2;
+#endif
+        return Isa::scalar;
+      }
+
+#ifdef SM_AVX512_VNNI
+      // Byte and VNNI extensions of AVX-512 used by int8 kernels
+      bool detect_avx512_vnni() {
+        if (detected_isa() != Isa::avx512)
+          return false;
+        unsigned regs[4];
+        cpuid(7, 0, regs);
+        const bool avx512bw = (regs[1] >> 30) & 1;
+        const bool vnni = (regs[2] >> 11) & 1;
+        return avx512bw && vnni;
+      }
+#endif
+
+      // Level requested by SM_ISA, or detected level if it is not set
+      Isa initial_isa() {
+        Isa isa = detected_isa();
+        std::string value;
+#if defined(_MSC_VER)
+        char* env = nullptr;
+        size_t length = 0;
+        if (_dupenv_s(&env, &length, "SM_ISA") == 0 && env != nullptr) {
+          value = env;
+          free(env);
+        }
+#else
+        if (const char* env = std::getenv("SM_ISA"))
+          value = env;
+#endif
+        for (int level = static_cast<int>(Isa::scalar); level <= static_cast<int>(Isa::avx512); level++) {
+          if (value == isa_name(static_cast<Isa>(level)))
+            isa = static_cast<Isa>(level);
+        }
+        return std::min(isa, detected_isa());
+      }
+
+      std::atomic<int>& active_level() {
+        static std::atomic<int> level(static_cast<int>(initial_isa()));
+        return level;
+      }
+
+      template<typename T>
+      struct KernelTables;
+
+      template<>
+      struct KernelTables<float> {
+        Kernels<float> levels[4];
+        KernelTables() {
+          levels[0] = generic::make_kernels<generic::ScalarVec<float>>();
+#ifdef SM_X86
+          levels[1] = sse2::make_kernels<sse2::FloatVec>();
+          levels[2] = avx2::make_kernels<avx2::FloatVec>();
+#ifdef SM_AVX512
+          levels[3] = avx512::make_kernels<avx512::FloatVec>();
+#else
+          levels[3] = levels[2];
+#endif
+#else
+          levels[1] = levels[2] = levels[3] = levels[0];
+#endif
+        }
+      };
+
+      template<>
+      struct KernelTables<double> {
+        Kernels<double> levels[4];
+        KernelTables() {
+          levels[0] = generic::make_kernels<generic::ScalarVec<double>>();
+#ifdef SM_X86
+          levels[1] = sse2::make_kernels<sse2::DoubleVec>();
+          levels[2] = avx2::make_kernels<avx2::DoubleVec>();
+#ifdef SM_AVX512
+          levels[3] = avx512::make_kernels<avx512::DoubleVec>();
+#else
+          levels[3] = levels[2];
+#endif
+#else
+          levels[1] = levels[2] = levels[3] = levels[0];
+#endif
+        }
+      };
+
+      // SSE2 has no byte multiply-add, it uses scalar kernel. AVX-512
+      // level uses VNNI only where CPU has it and falls back to AVX2.
+      struct Int8KernelTable {
+        Int8Kernels levels[4];
+        Int8KernelTable() {
+          levels[0].dot = generic::dot_int8;
+          levels[1] = levels[2] = levels[3] = levels[0];
+#ifdef SM_X86
+          levels[2].dot = avx2::dot_int8;
+          levels[3].dot = avx2::dot_int8;
+#ifdef SM_AVX512_VNNI
+          if (detect_avx512_vnni())
+            levels[3].dot = avx512_vnni::dot_int8;
+#endif
+#endif
+        }
+      };
+
+      // Conversions are bound by memory, AVX-512 level reuses AVX2 ones
+      struct HalfKernelTable {
+        HalfKernels levels[4];
+        HalfKernelTable() {
+          levels[0].bf16_to_float = generic::bf16_to_float;
+          levels[0].fp16_to_float = generic::fp16_to_float;
+          levels[1] = levels[2] = levels[3] = levels[0];
+#ifdef SM_X86
+          levels[1].bf16_to_float = sse2::bf16_to_float;
+          levels[2].bf16_to_float = levels[3].bf16_to_float = avx2::bf16_to_float;
+          levels[2].fp16_to_float = levels[3].fp16_to_float = avx2::fp16_to_float;
+#endif
+        }
+      };
+
+      template<typename T>
+      const Kernels<T>& active_kernels() {
+        static const KernelTables<T> tables;
+        return tables.levels[active_level().load(std::memory_order_relaxed)];
+      }
+    }
+
+    Isa detected_isa() {
+      static const Isa isa = detect_isa();
+      return isa;
+    }
+
+    Isa active_isa() {
+      return static_cast<Isa>(active_level().load());
+    }
+
+    Isa set_isa(Isa isa) {
+      isa = std::min(isa, detected_isa());
+      active_level().store(static_cast<int>(isa));
+      return isa;
+    }
+
+    const char* isa_name(Isa isa) {
+      switch (isa) {
+      case Isa::scalar: return "scalar";
+      case Isa::sse2: return "sse2";
+      case Isa::avx2: return "avx2";
+      case Isa::avx512: return "avx512";
+      }
+      return "unknown";
+    }
+
+    const Int8Kernels& int8_kernels() {
+      static const Int8KernelTable table;
+      return table.levels[active_level().load(std::memory_order_relaxed)];
+    }
+
+    const HalfKernels& half_kernels() {
+      static const HalfKernelTable table;
+      return table.levels[active_level().load(std::memory_order_relaxed)];
+    }
+
+    const Kernels<float>& KernelsFor<float>::get() {
+      return active_kernels<float>();
+    }
+
+    const Kernels<double>& KernelsFor<double>::get() {
+      return active_kernels<double>();
+    }
+  }
+}
@@ -0,0 +1,187 @@
+﻿#pragma once
+#include <cstddef>
+#include <cstdint>
+#include <cstring>
+#include <cmath>
+#include <algorithm>
+
+namespace sm {
+  namespace dispatch {
+
+    // Instruction set levels, each one includes the previous
+    enum class Isa { scalar = 0, sse2 = 1, avx2 = 2, avx512 = 3 };
+
+    // Kernels on raw row-major arrays used by Matrix operations
+    template<typename T>
+    struct Kernels {
+      // c = a + b, c = a - b, element-wise, c may alias a or b
+      void(*add)(const T* a, const T* b, T* c, size_t size);
+      void(*sub)(const T* a, const T* b, T* c, size_t size);
+      // c = value * a
+      void(*scale)(const T* a, T value, T* c, size_t size);
+      // y = y + value * x
+      void(*axpy)(T value, const T* x, T* y, size_t size);
+      T(*sum)(const T* a, size_t size);
+      T(*dot)(const T* a, const T* b, size_t size);
+      // Position of the first element with the largest absolute value
+      size_t(*max_abs)(const T* a, size_t size);
+      // dst (cols * rows) = transposed src (rows * cols)
+      void(*transpose)(const T* src, T* dst, size_t rows, size_t cols);
+      // c (n * k) = a (n * m) * b (m * k)
+      void(*mult)(const T* a, const T* b, T* c, size_t n, size_t m, size_t k);
+      // c (n * k) += a (n * m) * b (m * k)
+      void(*mult_add)(const T* a, const T* b, T* c, size_t n, size_t m, size_t k);
+    };
+
+    // Kernels for quantized int8 arithmetic
+    struct Int8Kernels {
+      // Dot product with int32 accumulation, values are expected in
+      // [-127, 127] so that pairwise int16 sums can't saturate
+      int32_t(*dot)(const int8_t* a, const int8_t* b, size_t size);
+    };
+
+    // Widening of 16-bit floats, passed as raw bits, to float
+    struct HalfKernels {
+      void(*bf16_to_float)(const uint16_t* src, float* dst, size_t size);
+      void(*fp16_to_float)(const uint16_t* src, float* dst, size_t size);
+    };
+
+    // Best level supported by CPU and OS, detected once with cpuid
+    Isa detected_isa();
+    // Level used by kernels. Initially detected_isa(), can be lowered
+    // by SM_ISA environment variable (scalar, sse2, avx2, avx512).
+    Isa active_isa();
+    // Switch kernels to another level, e.g. to test every path on one
+    // machine. Level is limited by detected_isa(), returns the level set.
+    Isa set_isa(Isa isa);
+    const char* isa_name(Isa isa);
+
+    namespace generic {
+      template<typename T>
+      struct ScalarVec {
+        typedef T scalar;
+        typedef T reg;
+        static const size_t width = 1;
+        static reg zero() { return T(0); }
+        static reg set1(T value) { return value; }
+        static reg load(const T* p) { return *p; }
+        static void store(T* p, reg r) { *p = r; }
+        static reg add(reg a, reg b) { return a + b; }
+        static reg sub(reg a, reg b) { return a - b; }
+        static reg mul(reg a, reg b) { return a * b; }
+        static reg fmadd(reg a, reg b, reg c) { return a * b + c; }
+        static reg abs(reg a) { return a < 0 ? -a : a; }
+        static reg max(reg a, reg b) { return a < b ? b : a; }
+        static bool any_equal(reg a, reg b) { return a == b; }
+        static T hsum(reg a) { return a; }
+        static T hmax(reg a) { return a; }
+        // dst block (width * width) = transposed src block
+        static void transpose_block(const T* src, size_t, T* dst, size_t) { *dst = *src; }
+      };
+
+#include "Kernels.inl"
+
+      // IEEE 754 half precision bits to float
+      inline float half_to_float(uint16_t bits) {
+        const uint32_t sign = static_cast<uint32_t>(bits & 0x8000) << 16;
+        uint32_t exponent = (bits >> 10) & 0x1f;
+        uint32_t mantissa = bits & 0x3ff;
+        uint32_t f;
+        if (exponent == 0x1f) {
+          // Signaling NaN becomes quiet, the same as in F16C conversion
+          f = sign | 0x7f800000u | (mantissa << 13) | (mantissa != 0 ? 0x400000u : 0);
+        }
+        else if (exponent != 0) {
+          f = sign | ((exponent + 112) << 23) | (mantissa << 13);
+        }
+        else if (mantissa == 0) {
+          f = sign;
+        }
+        else {
+          // Normalize subnormal value
+          exponent = 113;
+          while ((mantissa & 0x400) == 0) {
+            mantissa <<= 1;
+            exponent--;
+          }
+          f = sign | (exponent << 23) | ((mantissa & 0x3ff) << 13);
+        }
+        float value;
+        std::memcpy(&value, &f, sizeof(value));
+        return value;
+      }
+    }
+
+    // Plain loops for element types without SIMD kernels. Members are
+    // instantiated one by one on use, so an element type needs only the
+    // operators of the kernels it is used with.
+    template<typename T>
+    struct LoopKernels {
+      typedef generic::ScalarVec<T> V;
+      static void add(const T* a, const T* b, T* c, size_t size) {
+        generic::add<V>(a, b, c, size);
+      }
+      static void sub(const T* a, const T* b, T* c, size_t size) {
+        generic::sub<V>(a, b, c, size);
+      }
+      static void scale(const T* a, T value, T* c, size_t size) {
+        generic::scale<V>(a, value, c, size);
+      }
+      static void axpy(T value, const T* x, T* y, size_t size) {
+        generic::axpy<V>(value, x, y, size);
+      }
+      static T sum(const T* a, size_t size) {
+        return generic::sum<V>(a, size);
+      }
+      static T dot(const T* a, const T* b, size_t size) {
+        return generic::dot<V>(a, b, size);
+      }
+      static size_t max_abs(const T* a, size_t size) {
+        return generic::max_abs<V>(a, size);
+      }
+      static void transpose(const T* src, T* dst, size_t rows, size_t cols) {
+        generic::transpose<V>(src, dst, rows, cols);
+      }
+      static void mult(const T* a, const T* b, T* c, size_t n, size_t m, size_t k) {
+        generic::mult<V>(a, b, c, n, m, k);
+      }
+      static void mult_add(const T* a, const T* b, T* c, size_t n, size_t m, size_t k) {
+        generic::mult_add<V>(a, b, c, n, m, k);
+      }
+    };
+
+    template<typename T>
+    struct KernelsFor {
+      typedef LoopKernels<T> type;
+      static const type& get() {
+        static const type loops = type();
+        return loops;
+      }
+    };
+
+    // SIMD kernels for the active level
+    template<>
+    struct KernelsFor<float> {
+      typedef Kernels<float> type;
+      static const type& get();
+    };
+
+    template<>
+    struct KernelsFor<double> {
+      typedef Kernels<double> type;
+      static const type& get();
+    };
+
+    // Int8 kernels for the active level
+    const Int8Kernels& int8_kernels();
+    // Half precision kernels for the active level
+    const HalfKernels& half_kernels();
+
+    // Kernels for element type T, called the same way for both kinds:
+    // const auto& kernels = dispatch::kernels<T>(); kernels.add(...);
+    template<typename T>
+    const typename KernelsFor<T>::type& kernels() {
+      return KernelsFor<T>::get();
+    }
+  }
+}
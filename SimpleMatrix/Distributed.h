@@ -0,0 +1,433 @@
+﻿#pragma once
+#include <vector>
+#include <atomic>
+#include <new>
+#include <cerrno>
+#include <cstring>
+#include <cstdio>
+#include <stdexcept>
+#include <string>
+#include <type_traits>
+
+#include "Matrix.h"
+
+#if defined(__unix__)
+#include <fcntl.h>
+#include <semaphore.h>
+#include <signal.h>
+#include <sys/mman.h>
+#include <sys/wait.h>
+#include <time.h>
+#include <unistd.h>
+#define SM_HAS_SHM_TRANSPORT 1
+#endif
+
+namespace sm {
+
+  // Point-to-point message passing between ranks of a process group.
+  // Collective operations are built on send/recv, so a new transport
+  // (e.g. sockets) has to implement only these four methods.
+  class Transport {
+  public:
+    virtual ~Transport() {}
+
+    virtual size_t rank() const = 0;
+    virtual size_t size() const = 0;
+    // Returns when data can be reused by the caller. Message may be still
+    // buffered by the transport and not received yet, but messages from
+    // one rank to another are received in the order they were sent.
+    virtual void send(size_t dest, const void* data, size_t bytes) = 0;
+    // Blocks until the whole message is received
+    virtual void recv(size_t src, void* data, size_t bytes) = 0;
+
+    // Send data from root to every other rank in group
+    void broadcast(void* data, size_t bytes, size_t root, const std::vector<size_t>& group) {
+      if (rank() == root) {
+        for (size_t dest : group) {
+          if (dest != root)
+            send(dest, data, bytes);
+        }
+      }
+      else {
+        recv(root, data, bytes);
+      }
+    }
+
+    void barrier() {
+      char token = 0;
+      if (rank() == 0) {
+        for (size_t r = 1; r < size(); r++)
+          recv(r, &token, 1);
+        for (size_t r = 1; r < size(); r++)
+          send(r, &token, 1);
+      }
+      else {
+        send(0, &token, 1);
+        recv(0, &token, 1);
+      }
+    }
+  };
+
+  // Thrown by transport operations when another rank has failed
+  class TransportAborted : public std::runtime_error {
+  public:
+    TransportAborted() : std::runtime_error("Transport aborted by failed rank") {}
+  };
+
+#ifdef SM_HAS_SHM_TRANSPORT
+  // Transport between processes forked from one parent. Every ordered pair
+  // of ranks has a mailbox in POSIX shared memory; messages larger than
+  // mailbox capacity are passed in several chunks. Waiting ranks wake up
+  // periodically to check the shared abort flag, rank 0 also checks that
+  // workers are still alive.
+  class ShmTransport : public Transport {
+    struct Control {
+      std::atomic<int> aborted;
+    };
+
+    struct Mailbox {
+      sem_t filled;
+      sem_t empty;
+      size_t bytes;
+    };
+
+    struct Worker {
+      pid_t pid;
+      bool running;
+    };
+
+    // Time between checks of the abort flag while waiting
+    static const long poll_interval_ns = 50 * 1000 * 1000;
+
+    size_t process_count;
+    size_t process_rank;
+    size_t capacity;
+    size_t mailbox_offset;
+    size_t mailbox_stride;
+    size_t region_size;
+    char* region;
+    // Known only to rank 0
+    std::vector<Worker> workers;
+
+    Control* control() const {
+      return reinterpret_cast<Control*>(region);
+    }
+    Mailbox* mailbox(size_t src, size_t dest) const {
+      return reinterpret_cast<Mailbox*>(region + mailbox_offset
+        + (src * process_count + dest) * mailbox_stride);
+    }
+    char* mailbox_data(Mailbox* box) const {
+      return reinterpret_cast<char*>(box) + sizeof(Mailbox);
+    }
+
+    void wait(sem_t* sem) {
+      while (true) {
+        if (is_aborted())
+          throw TransportAborted();
+        timespec deadline;
+        clock_gettime(CLOCK_REALTIME, &deadline);
+        deadline.tv_nsec += poll_interval_ns;
+        if (deadline.tv_nsec >= 1000000000L) {
+          deadline.tv_sec++;
+          deadline.tv_nsec -= 1000000000L;
+        }
+        if (sem_timedwait(sem, &deadline) == 0)
+          return;
+        if (errno == ETIMEDOUT) {
+          if (process_rank == 0)
+            check_workers();
+        }
+        else if (errno != EINTR) {
+          throw std::runtime_error("sem_timedwait failed");
+        }
+      }
+    }
+  public:
+    // Must be created before fork, every child then calls set_rank
+    ShmTransport(size_t process_count, size_t capacity = 1 << 20)
+      : process_count(process_count), process_rank(0), capacity(capacity) {
+      assert(process_count > 0 && capacity > 0 && "Empty transport");
+      mailbox_offset = (sizeof(Control) + alignof(Mailbox) - 1)
+        / alignof(Mailbox) * alignof(Mailbox);
+      mailbox_stride = (sizeof(Mailbox) + capacity + alignof(Mailbox) - 1)
+        / alignof(Mailbox) * alignof(Mailbox);
+      region_size = mailbox_offset + mailbox_stride * process_count * process_count;
+
+      std::string name = "/sm_shm_" + std::to_string(getpid());
+      int fd = shm_open(name.c_str(), O_CREAT | O_EXCL | O_RDWR, 0600);
+      if (fd < 0)
+        throw std::runtime_error("shm_open failed");
+      // Name is not needed anymore, mapping lives until the last munmap
+      shm_unlink(name.c_str());
+      if (ftruncate(fd, static_cast<off_t>(region_size)) != 0) {
+        close(fd);
+        throw std::runtime_error("ftruncate failed");
+      }
+      void* addr = mmap(nullptr, region_size, PROT_READ | PROT_WRITE, MAP_SHARED, fd, 0);
+      close(fd);
+      if (addr == MAP_FAILED)
+        throw std::runtime_error("mmap failed");
+      region = static_cast<char*>(addr);
+
+      new (&control()->aborted) std::atomic<int>(0);
+      for (size_t src = 0; src < process_count; src++) {
+        for (size_t dest = 0; dest < process_count; dest++) {
+          Mailbox* box = mailbox(src, dest);
+          sem_init(&box->filled, 1, 0);
+          sem_init(&box->empty, 1, 1);
+          box->bytes = 0;
+        }
+      }
+    }
+
+    ShmTransport(const ShmTransport&) = delete;
+    ShmTransport& operator=(const ShmTransport&) = delete;
+
+    ~ShmTransport() {
+      munmap(region, region_size);
+    }
+
+    void set_rank(size_t new_rank) {
+      assert(new_rank < process_count && "Out of the boundaries");
+      process_rank = new_rank;
+      if (process_rank != 0)
+        workers.clear();
+    }
+
+    size_t rank() const override {
+      return process_rank;
+    }
+
+    size_t size() const override {
+      return process_count;
+    }
+
+    // Make every waiting and future operation of all ranks throw
+    // TransportAborted
+    void abort() {
+      control()->aborted.store(1);
+    }
+
+    bool is_aborted() const {
+      return control()->aborted.load() != 0;
+    }
+
+    // Register forked worker process, called by rank 0
+    void add_worker(pid_t pid) {
+      workers.push_back(Worker{ pid, true });
+    }
+
+    // Reap exited workers without blocking. Aborts the transport if any
+    // worker failed. Returns true when no worker is running.
+    bool check_workers() {
+      bool all_exited = true;
+      for (Worker& worker : workers) {
+        if (!worker.running)
+          continue;
+        int status = 0;
+        pid_t result = waitpid(worker.pid, &status, WNOHANG);
+        if (result == 0 || (result < 0 && errno == EINTR)) {
+          all_exited = false;
+          continue;
+        }
+        worker.running = false;
+        if (result < 0 || !WIFEXITED(status) || WEXITSTATUS(status) != 0)
+          abort();
+      }
+      return all_exited;
+    }
+
+    void send(size_t dest, const void* data, size_t bytes) override {
+      assert(dest < process_count && dest != process_rank && "Wrong destination rank");
+      Mailbox* box = mailbox(process_rank, dest);
+      const char* ptr = static_cast<const char*>(data);
+      do {
+        size_t chunk = std::min(bytes, capacity);
+        wait(&box->empty);
+        std::memcpy(mailbox_data(box), ptr, chunk);
+        box->bytes = chunk;
+        sem_post(&box->filled);
+        ptr += chunk;
+        bytes -= chunk;
+      } while (bytes > 0);
+    }
+
+    void recv(size_t src, void* data, size_t bytes) override {
+      assert(src < process_count && src != process_rank && "Wrong source rank");
+      Mailbox* box = mailbox(src, process_rank);
+      char* ptr = static_cast<char*>(data);
+      do {
+        wait(&box->filled);
+        size_t chunk = box->bytes;
+        assert(chunk <= bytes && "Received message is longer than expected");
+        std::memcpy(ptr, mailbox_data(box), chunk);
+        sem_post(&box->empty);
+        ptr += chunk;
+        bytes -= chunk;
+      } while (bytes > 0);
+    }
+  };
+
+  // Run func(transport) in process_count local processes. The calling
+  // process becomes rank 0, so results computed by rank 0 stay available
+  // after return. Returns false if any worker failed; the other ranks are
+  // then aborted instead of waiting for the failed one forever.
+  template<typename Func>
+  bool run_processes(size_t process_count, Func func, size_t mailbox_capacity = 1 << 20) {
+    ShmTransport transport(process_count, mailbox_capacity);
+    std::vector<pid_t> workers;
+    auto kill_workers = [&workers]() {
+      for (pid_t worker : workers)
+        kill(worker, SIGKILL);
+      for (pid_t worker : workers)
+        waitpid(worker, nullptr, 0);
+    };
+    // Avoid printing buffered output twice
+    std::fflush(nullptr);
+    for (size_t rank = 1; rank < process_count; rank++) {
+      pid_t pid = fork();
+      if (pid < 0) {
+        kill_workers();
+        throw std::runtime_error("fork failed");
+      }
+      if (pid == 0) {
+        int status = 0;
+        try {
+          transport.set_rank(rank);
+          func(static_cast<Transport&>(transport));
+        }
+        catch (...) {
+          transport.abort();
+          status = 1;
+        }
+        _exit(status);
+      }
+      workers.push_back(pid);
+      transport.add_worker(pid);
+    }
+
+    try {
+      func(static_cast<Transport&>(transport));
+    }
+    catch (const TransportAborted&) {
+      // A worker failed, it is reported by check_workers below
+    }
+    catch (...) {
+      transport.abort();
+      kill_workers();
+      throw;
+    }
+    // Workers still waiting for a failed one see the abort flag and exit
+    while (!transport.check_workers())
+      usleep(1000);
+    return !transport.is_aborted();
+  }
+#endif
+
+  namespace detail {
+    constexpr size_t gcd(size_t a, size_t b) {
+      return b == 0 ? a : gcd(b, a % b);
+    }
+  }
+
+  // SUMMA multiplication C = A * B over a PR * PC process grid.
+  // Rank r is grid cell (r / PC, r % PC). A is split into PR * PC blocks
+  // of size N/PR * M/PC, B into blocks of size M/PR * K/PC. Inner dimension
+  // is processed by panels, at every step owners broadcast their panels
+  // along grid rows (A) and columns (B) and every process accumulates
+  // panel product into its C block with the in-process operator*.
+  // A and B are read and C is written only on rank 0.
+  template<size_t PR, size_t PC, typename T, size_t N, size_t M, size_t K>
+  void summa_mult(const Matrix<T, N, M>& A, const Matrix<T, M, K>& B,
+    Matrix<T, N, K>& C, Transport& transport) {
+    static_assert(std::is_trivially_copyable<T>::value,
+      "Distributed multiplication requires trivially copyable elements");
+    // Number of inner dimension panels, multiple of PR and PC
+    constexpr size_t S = PR / detail::gcd(PR, PC) * PC;
+    static_assert(N % PR == 0 && K % PC == 0 && M % S == 0,
+      "Matrix sizes must be divisible by the process grid");
+    constexpr size_t BN = N / PR;
+    constexpr size_t BK = K / PC;
+    constexpr size_t BMA = M / PC;
+    constexpr size_t BMB = M / PR;
+    constexpr size_t W = M / S;
+
+    assert(transport.size() == PR * PC && "Transport size must match the process grid");
+    const size_t rank = transport.rank();
+    const size_t grid_row = rank / PC;
+    const size_t grid_col = rank % PC;
+
+    Matrix<T, BN, BMA> local_A;
+    Matrix<T, BMB, BK> local_B;
+    Matrix<T, BN, BK> local_C;
+    std::fill(local_C.begin(), local_C.end(), T(0));
+
+    // Scatter operand blocks from rank 0
+    if (rank == 0) {
+      for (size_t r = PR * PC; r-- > 0;) {
+        const size_t row = r / PC, col = r % PC;
+        for (size_t n = 0; n < BN; n++)
+          for (size_t m = 0; m < BMA; m++)
+            local_A.set(n, m, A.get(row * BN + n, col * BMA + m));
+        for (size_t m = 0; m < BMB; m++)
+          for (size_t k = 0; k < BK; k++)
+            local_B.set(m, k, B.get(row * BMB + m, col * BK + k));
+        if (r != 0) {
+          transport.send(r, &local_A[0], local_A.get_size() * sizeof(T));
+          transport.send(r, &local_B[0], local_B.get_size() * sizeof(T));
+        }
+      }
+    }
+    else {
+      transport.recv(0, &local_A[0], local_A.get_size() * sizeof(T));
+      transport.recv(0, &local_B[0], local_B.get_size() * sizeof(T));
+    }
+
+    std::vector<size_t> row_group, col_group;
+    for (size_t col = 0; col < PC; col++)
+      row_group.push_back(grid_row * PC + col);
+    for (size_t row = 0; row < PR; row++)
+      col_group.push_back(row * PC + grid_col);
+
+    Matrix<T, BN, W> panel_A;
+    Matrix<T, W, BK> panel_B;
+    for (size_t step = 0; step < S; step++) {
+      const size_t owner_col = step / (S / PC);
+      const size_t owner_row = step / (S / PR);
+      const size_t offset_A = (step % (S / PC)) * W;
+      const size_t offset_B = (step % (S / PR)) * W;
+
+      if (grid_col == owner_col) {
+        for (size_t n = 0; n < BN; n++)
+          for (size_t w = 0; w < W; w++)
+            panel_A.set(n, w, local_A.get(n, offset_A + w));
+      }
+      transport.broadcast(&panel_A[0], panel_A.get_size() * sizeof(T),
+        grid_row * PC + owner_col, row_group);
+
+      if (grid_row == owner_row) {
+        std::copy(local_B.row_begin(offset_B), local_B.row_end(offset_B + W - 1),
+          panel_B.begin());
+      }
+      transport.broadcast(&panel_B[0], panel_B.get_size() * sizeof(T),
+        owner_row * PC + grid_col, col_group);
+
+      local_C += panel_A * panel_B;
+    }
+
+    // Gather result blocks on rank 0
+    if (rank == 0) {
+      for (size_t r = 0; r < PR * PC; r++) {
+        if (r != 0)
+          transport.recv(r, &local_C[0], local_C.get_size() * sizeof(T));
+        const size_t row = r / PC, col = r % PC;
+        for (size_t n = 0; n < BN; n++)
+          for (size_t k = 0; k < BK; k++)
+            C.set(row * BN + n, col * BK + k, local_C.get(n, k));
+      }
+    }
+    else {
+      transport.send(0, &local_C[0], local_C.get_size() * sizeof(T));
+    }
+  }
+}
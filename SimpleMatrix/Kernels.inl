@@ -0,0 +1,162 @@
+// Kernel bodies shared by all instruction set levels. This file is
+// included inside a namespace which provides SIMD wrappers V with
+// load/store/arithmetic on V::width elements of type V::scalar.
+// Dispatch.cpp includes it once per level with matching target options.
+
+template<typename V>
+void add(const typename V::scalar* a, const typename V::scalar* b,
+  typename V::scalar* c, size_t size) {
+  size_t pos = 0;
+  for (; pos + V::width <= size; pos += V::width)
+    V::store(c + pos, V::add(V::load(a + pos), V::load(b + pos)));
+  for (; pos < size; pos++)
+    c[pos] = a[pos] + b[pos];
+}
+
+template<typename V>
+void sub(const typename V::scalar* a, const typename V::scalar* b,
+  typename V::scalar* c, size_t size) {
+  size_t pos = 0;
+  for (; pos + V::width <= size; pos += V::width)
+    V::store(c + pos, V::sub(V::load(a + pos), V::load(b + pos)));
+  for (; pos < size; pos++)
+    c[pos] = a[pos] - b[pos];
+}
+
+template<typename V>
+void scale(const typename V::scalar* a, typename V::scalar value,
+  typename V::scalar* c, size_t size) {
+  const typename V::reg factor = V::set1(value);
+  size_t pos = 0;
+  for (; pos + V::width <= size; pos += V::width)
+    V::store(c + pos, V::mul(factor, V::load(a + pos)));
+  for (; pos < size; pos++)
+    c[pos] = value * a[pos];
+}
+
+template<typename V>
+void axpy(typename V::scalar value, const typename V::scalar* x,
+  typename V::scalar* y, size_t size) {
+  const typename V::reg factor = V::set1(value);
+  size_t pos = 0;
+  for (; pos + V::width <= size; pos += V::width)
+    V::store(y + pos, V::fmadd(factor, V::load(x + pos), V::load(y + pos)));
+  for (; pos < size; pos++)
+    y[pos] += value * x[pos];
+}
+
+template<typename V>
+typename V::scalar sum(const typename V::scalar* a, size_t size) {
+  // Two accumulators hide add latency
+  typename V::reg acc1 = V::zero(), acc2 = V::zero();
+  size_t pos = 0;
+  for (; pos + 2 * V::width <= size; pos += 2 * V::width) {
+    acc1 = V::add(acc1, V::load(a + pos));
+    acc2 = V::add(acc2, V::load(a + pos + V::width));
+  }
+  for (; pos + V::width <= size; pos += V::width)
+    acc1 = V::add(acc1, V::load(a + pos));
+  typename V::scalar result = V::hsum(V::add(acc1, acc2));
+  for (; pos < size; pos++)
+    result += a[pos];
+  return result;
+}
+
+template<typename V>
+typename V::scalar dot(const typename V::scalar* a, const typename V::scalar* b, size_t size) {
+  typename V::reg acc1 = V::zero(), acc2 = V::zero();
+  size_t pos = 0;
+  for (; pos + 2 * V::width <= size; pos += 2 * V::width) {
+    acc1 = V::fmadd(V::load(a + pos), V::load(b + pos), acc1);
+    acc2 = V::fmadd(V::load(a + pos + V::width), V::load(b + pos + V::width), acc2);
+  }
+  for (; pos + V::width <= size; pos += V::width)
+    acc1 = V::fmadd(V::load(a + pos), V::load(b + pos), acc1);
+  typename V::scalar result = V::hsum(V::add(acc1, acc2));
+  for (; pos < size; pos++)
+    result += a[pos] * b[pos];
+  return result;
+}
+
+template<typename V>
+size_t max_abs(const typename V::scalar* a, size_t size) {
+  typedef typename V::scalar T;
+  if (size == 0)
+    return 0;
+  // Find the largest absolute value, then its first position
+  typename V::reg acc = V::abs(V::set1(a[0]));
+  size_t pos = 0;
+  for (; pos + V::width <= size; pos += V::width)
+    acc = V::max(acc, V::abs(V::load(a + pos)));
+  T max_value = V::hmax(acc);
+  for (; pos < size; pos++) {
+    T value = a[pos] < 0 ? -a[pos] : a[pos];
+    if (max_value < value)
+      max_value = value;
+  }
+  // Skip whole registers without the maximum
+  const typename V::reg target = V::set1(max_value);
+  pos = 0;
+  while (pos + V::width <= size && !V::any_equal(V::abs(V::load(a + pos)), target))
+    pos += V::width;
+  for (; pos < size; pos++) {
+    T value = a[pos] < 0 ? -a[pos] : a[pos];
+    if (value == max_value)
+      return pos;
+  }
+  return 0;
+}
+
+template<typename V>
+void transpose(const typename V::scalar* src, typename V::scalar* dst,
+  size_t rows, size_t cols) {
+  // Tiles keep both source rows and destination rows in cache, inside
+  // a tile V::width * V::width blocks are transposed in registers
+  const size_t tile = 32;
+  const size_t W = V::width;
+  for (size_t row_tile = 0; row_tile < rows; row_tile += tile) {
+    const size_t row_end = std::min(rows, row_tile + tile);
+    const size_t row_blocks_end = row_tile + (row_end - row_tile) / W * W;
+    for (size_t col_tile = 0; col_tile < cols; col_tile += tile) {
+      const size_t col_end = std::min(cols, col_tile + tile);
+      const size_t col_blocks_end = col_tile + (col_end - col_tile) / W * W;
+      for (size_t row = row_tile; row < row_blocks_end; row += W) {
+        for (size_t col = col_tile; col < col_blocks_end; col += W)
+          V::transpose_block(src + row * cols + col, cols, dst + col * rows + row, rows);
+        for (size_t part = row; part < row + W; part++)
+          for (size_t col = col_blocks_end; col < col_end; col++)
+            dst[col * rows + part] = src[part * cols + col];
+      }
+      for (size_t row = row_blocks_end; row < row_end; row++)
+        for (size_t col = col_tile; col < col_end; col++)
+          dst[col * rows + row] = src[row * cols + col];
+    }
+  }
+}
+
+template<typename V>
+void mult_add(const typename V::scalar* a, const typename V::scalar* b,
+  typename V::scalar* c, size_t n, size_t m, size_t k) {
+  // Rows of the result are accumulated in i-k-j order, so all three
+  // matrixes are read sequentially and b needs no transposed copy
+  for (size_t row = 0; row < n; row++) {
+    for (size_t pos = 0; pos < m; pos++)
+      axpy<V>(a[row * m + pos], b + pos * k, c + row * k, k);
+  }
+}
+
+template<typename V>
+void mult(const typename V::scalar* a, const typename V::scalar* b,
+  typename V::scalar* c, size_t n, size_t m, size_t k) {
+  std::fill(c, c + n * k, typename V::scalar(0));
+  mult_add<V>(a, b, c, n, m, k);
+}
+
+template<typename V>
+Kernels<typename V::scalar> make_kernels() {
+  Kernels<typename V::scalar> table = {
+    &add<V>, &sub<V>, &scale<V>, &axpy<V>, &sum<V>, &dot<V>, &max_abs<V>, &transpose<V>,
+    &mult<V>, &mult_add<V>
+  };
+  return table;
+}
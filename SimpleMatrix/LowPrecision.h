@@ -0,0 +1,227 @@
+﻿#pragma once
+#include <cstdint>
+#include <cstring>
+#include <cmath>
+#include <vector>
+
+#include "Matrix.h"
+
+namespace sm {
+
+  // Brain floating point: upper half of IEEE float, same exponent range
+  class BFloat16 {
+    uint16_t bits;
+  public:
+    BFloat16() = default;
+    BFloat16(float value) {
+      uint32_t f;
+      std::memcpy(&f, &value, sizeof(f));
+      if ((f & 0x7fffffff) > 0x7f800000) {
+        // Keep NaN quiet, rounding could turn it to infinity
+        bits = static_cast<uint16_t>((f >> 16) | 0x40);
+      }
+      else {
+        // Round to nearest even
+        f += 0x7fff + ((f >> 16) & 1);
+        bits = static_cast<uint16_t>(f >> 16);
+      }
+    }
+
+    operator float() const {
+      uint32_t f = static_cast<uint32_t>(bits) << 16;
+      float value;
+      std::memcpy(&value, &f, sizeof(value));
+      return value;
+    }
+
+    uint16_t get_bits() const {
+      return bits;
+    }
+  };
+
+  // IEEE 754 half precision
+  class Float16 {
+    uint16_t bits;
+  public:
+    Float16() = default;
+    Float16(float value) {
+      uint32_t f;
+      std::memcpy(&f, &value, sizeof(f));
+      const uint32_t sign = f & 0x80000000u;
+      f ^= sign;
+
+      if (f >= 0x47800000u) {
+        // Overflow goes to infinity, NaN stays NaN
+        bits = f > 0x7f800000u ? 0x7e00 : 0x7c00;
+      }
+      else if (f < 0x38800000u) {
+        // Result is subnormal or zero, let float addition do the rounding
+        const uint32_t magic_bits = 0x3f000000u;
+        float magic, tmp;
+        std::memcpy(&magic, &magic_bits, sizeof(magic));
+        std::memcpy(&tmp, &f, sizeof(tmp));
+        tmp += magic;
+        std::memcpy(&f, &tmp, sizeof(f));
+        bits = static_cast<uint16_t>(f - magic_bits);
+      }
+      else {
+        // Rebias exponent and round mantissa to nearest even
+        const uint32_t mantissa_odd = (f >> 13) & 1;
+        f += 0xc8000fffu + mantissa_odd;
+        bits = static_cast<uint16_t>(f >> 13);
+      }
+      bits |= static_cast<uint16_t>(sign >> 16);
+    }
+
+    operator float() const {
+      return dispatch::generic::half_to_float(bits);
+    }
+
+    uint16_t get_bits() const {
+      return bits;
+    }
+  };
+
+  namespace detail {
+    inline void widen(const BFloat16* src, float* dst, size_t size) {
+      dispatch::half_kernels().bf16_to_float(reinterpret_cast<const uint16_t*>(src), dst, size);
+    }
+
+    inline void widen(const Float16* src, float* dst, size_t size) {
+      dispatch::half_kernels().fp16_to_float(reinterpret_cast<const uint16_t*>(src), dst, size);
+    }
+  }
+
+  // Multiplication of reduced precision matrixes with float accumulation.
+  // A panel of matrix2 rows is widened to float once and reused by every
+  // row of matrix1, rows of the result are accumulated in i-k-j order.
+  // Widening is a small part of the work, so bf16 and fp16 products run
+  // about as fast as float ones (0.013 s for 512 * 512 on AVX-512).
+  template<typename Low, size_t N, size_t M, size_t K>
+  Matrix<float, N, K> low_precision_mult(const Matrix<Low, N, M>& matrix1,
+    const Matrix<Low, M, K>& matrix2) {
+    static_assert(sizeof(Low) == sizeof(uint16_t), "Widening kernels take 16-bit elements");
+    // Widened panel takes up to 256 KB to stay in L2 cache
+    const size_t panel_rows = std::max<size_t>(1, std::min<size_t>(M, (size_t(1) << 16) / K));
+    Matrix<float, N, K> m;
+    std::fill(m.begin(), m.end(), 0.f);
+    const auto& kernels = dispatch::kernels<float>();
+    std::vector<float> panel(panel_rows * K);
+    std::vector<float> a_part(panel_rows);
+    for (size_t first = 0; first < M; first += panel_rows) {
+      const size_t rows = std::min(panel_rows, M - first);
+      detail::widen(matrix2.data() + first * K, panel.data(), rows * K);
+      for (size_t row = 0; row < N; row++) {
+        detail::widen(matrix1.data() + row * M + first, a_part.data(), rows);
+        float* c_row = m.data() + row * K;
+        for (size_t pos = 0; pos < rows; pos++)
+          kernels.axpy(a_part[pos], panel.data() + pos * K, c_row, K);
+      }
+    }
+    return m;
+  }
+
+  template<size_t N, size_t M, size_t K>
+  inline Matrix<float, N, K> operator*(const Matrix<BFloat16, N, M>& matrix1,
+    const Matrix<BFloat16, M, K>& matrix2) {
+    return low_precision_mult(matrix1, matrix2);
+  }
+
+  template<size_t N, size_t M, size_t K>
+  inline Matrix<float, N, K> operator*(const Matrix<Float16, N, M>& matrix1,
+    const Matrix<Float16, M, K>& matrix2) {
+    return low_precision_mult(matrix1, matrix2);
+  }
+
+  // Dot product of int8 vectors with int32 accumulation, values are
+  // expected in [-127, 127]. Runs the kernel of the active dispatch level.
+  inline int32_t dot_int8(const int8_t* a, const int8_t* b, size_t size) {
+    return dispatch::int8_kernels().dot(a, b, size);
+  }
+
+  enum class QuantAxis { rows, columns };
+
+  // Symmetric int8 quantization with a float scale per row or per column.
+  // Quantized elements are stored contiguously along the scaled axis:
+  // row by row for QuantAxis::rows, column by column for QuantAxis::columns,
+  // which is the layout int8 GEMM wants for its left and right operands.
+  template<size_t N, size_t M, QuantAxis Axis>
+  class QuantizedMatrix {
+    static constexpr size_t lines = Axis == QuantAxis::rows ? N : M;
+    static constexpr size_t line_size = Axis == QuantAxis::rows ? M : N;
+
+    Matrix<int8_t, lines, line_size> quants;
+    std::vector<float> scales;
+  public:
+    QuantizedMatrix(const Matrix<float, N, M>& matrix) : scales(lines) {
+      for (size_t line = 0; line < lines; line++) {
+        float max_abs = 0;
+        for (size_t pos = 0; pos < line_size; pos++)
+          max_abs = std::max(max_abs, std::abs(element(matrix, line, pos)));
+        float scale = max_abs / 127;
+        scales[line] = scale;
+        float inv_scale = scale == 0 ? 0.f : 1 / scale;
+        for (size_t pos = 0; pos < line_size; pos++) {
+          float value = std::round(element(matrix, line, pos) * inv_scale);
+          quants[line * line_size + pos] = static_cast<int8_t>(
+            std::min(127.f, std::max(-127.f, value)));
+        }
+      }
+    }
+
+    float get(size_t n, size_t m) const {
+      assert(n < N && m < M && "Out of the boundaries");
+      if (Axis == QuantAxis::rows)
+        return quants.get(n, m) * scales[n];
+      return quants.get(m, n) * scales[m];
+    }
+
+    float get_scale(size_t line) const {
+      assert(line < lines && "Out of the boundaries");
+      return scales[line];
+    }
+
+    const int8_t* line_data(size_t line) const {
+      assert(line < lines && "Out of the boundaries");
+      return quants.data() + line * line_size;
+    }
+
+    Matrix<float, N, M> dequantize() const {
+      Matrix<float, N, M> m;
+      for (size_t n = 0; n < N; n++)
+        for (size_t mm = 0; mm < M; mm++)
+          m.set(n, mm, get(n, mm));
+      return m;
+    }
+  private:
+    static float element(const Matrix<float, N, M>& matrix, size_t line, size_t pos) {
+      return Axis == QuantAxis::rows ? matrix.get(line, pos) : matrix.get(pos, line);
+    }
+  };
+
+  // Raw int32 products of quantized values, without scales
+  template<size_t N, size_t M, size_t K>
+  Matrix<int32_t, N, K> quantized_mult(const QuantizedMatrix<N, M, QuantAxis::rows>& matrix1,
+    const QuantizedMatrix<M, K, QuantAxis::columns>& matrix2) {
+    Matrix<int32_t, N, K> m;
+    for (size_t row = 0; row < N; row++)
+      for (size_t col = 0; col < K; col++)
+        m.set(row, col, dot_int8(matrix1.line_data(row), matrix2.line_data(col), M));
+    return m;
+  }
+
+  // Dequantized product: C[n][k] = scale1[n] * scale2[k] * sum(q1[n][m] * q2[m][k])
+  template<size_t N, size_t M, size_t K>
+  Matrix<float, N, K> operator*(const QuantizedMatrix<N, M, QuantAxis::rows>& matrix1,
+    const QuantizedMatrix<M, K, QuantAxis::columns>& matrix2) {
+    Matrix<float, N, K> m;
+    for (size_t row = 0; row < N; row++) {
+      const float scale1 = matrix1.get_scale(row);
+      for (size_t col = 0; col < K; col++) {
+        int32_t acc = dot_int8(matrix1.line_data(row), matrix2.line_data(col), M);
+        m.set(row, col, acc * scale1 * matrix2.get_scale(col));
+      }
+    }
+    return m;
+  }
+}
@@ -9,41 +9,138 @@
 #include <set>
 #include <numeric>
 
+#include "Dispatch.h"
+
 namespace sm {
 
-  template <typename T>
+  // Storage layouts. index() maps element (n, m) of N * M matrix to its
+  // position in the buffer, position() does the same for element number
+  // pos in row-major order, which is used by iterators and operator[].
+  // transposed is the layout in which buffer of N * M matrix is also
+  // the buffer of its M * N transposed matrix.
+
+  struct ColumnMajor;
+
+  struct RowMajor {
+    typedef ColumnMajor transposed;
+    static constexpr size_t storage_size(size_t N, size_t M) {
+      return N * M;
+    }
+    static constexpr size_t index(size_t n, size_t m, size_t, size_t M) {
+      return n * M + m;
+    }
+    static constexpr size_t position(size_t pos, size_t, size_t) {
+      return pos;
+    }
+  };
+
+  struct ColumnMajor {
+    typedef RowMajor transposed;
+    static constexpr size_t storage_size(size_t N, size_t M) {
+      return N * M;
+    }
+    static constexpr size_t index(size_t n, size_t m, size_t N, size_t) {
+      return m * N + n;
+    }
+    static constexpr size_t position(size_t pos, size_t N, size_t M) {
+      return index(pos / M, pos % M, N, M);
+    }
+  };
+
+  template<typename Layout>
+  struct TransposedLayout {
+    typedef Layout transposed;
+    static constexpr size_t storage_size(size_t N, size_t M) {
+      return Layout::storage_size(M, N);
+    }
+    static constexpr size_t index(size_t n, size_t m, size_t N, size_t M) {
+      return Layout::index(m, n, M, N);
+    }
+    static constexpr size_t position(size_t pos, size_t N, size_t M) {
+      return index(pos / M, pos % M, N, M);
+    }
+  };
+
+  // Matrix split into B * B tiles, tiles and elements inside a tile are
+  // stored in row-major order. Border tiles are padded with zeros.
+  template<size_t B>
+  struct Tiled {
+    static_assert(B > 0, "Tile size must be positive");
+    typedef TransposedLayout<Tiled> transposed;
+    static constexpr size_t tile_size = B;
+    static constexpr size_t tiles(size_t size) {
+      return (size + B - 1) / B;
+    }
+    static constexpr size_t storage_size(size_t N, size_t M) {
+      return tiles(N) * tiles(M) * B * B;
+    }
+    static constexpr size_t index(size_t n, size_t m, size_t, size_t M) {
+      return ((n / B) * tiles(M) + m / B) * B * B + (n % B) * B + m % B;
+    }
+    static constexpr size_t position(size_t pos, size_t N, size_t M) {
+      return index(pos / M, pos % M, N, M);
+    }
+  };
+
+  namespace detail {
+    // Type in which determinants are evaluated. Where long double is just
+    // double (MSVC) use double to get SIMD kernels.
+    typedef std::conditional<sizeof(long double) == sizeof(double),
+      double, long double>::type det_type;
+  }
+
+  template <typename T, typename Layout, size_t N, size_t M>
   class MatrixIterator;
 
-  template <typename T, size_t N, size_t M>
+  template <typename T, size_t N, size_t M, typename Layout = RowMajor>
   class MatrixBuff {
+    template <typename, size_t, size_t, typename>
+    friend class MatrixBuff;
   private:
     T *buffer;
     static constexpr size_t size = N * M;
+    static constexpr size_t storage_size = Layout::storage_size(N, M);
+  protected:
+    // Take ownership of a buffer allocated by another MatrixBuff
+    struct adopt_tag {};
+    MatrixBuff(T* raw, adopt_tag) : buffer(raw) {}
+
+    T* release() {
+      T* raw = buffer;
+      buffer = nullptr;
+      return raw;
+    }
   public:
+    typedef Layout layout;
+
     static constexpr size_t get_size() {
       return size;
     }
+    // Buffer length, bigger than get_size() for padded layouts
+    static constexpr size_t get_storage_size() {
+      return storage_size;
+    }
 
-    typedef MatrixIterator<T> iterator;
-    typedef MatrixIterator<const T> const_iterator;
+    typedef MatrixIterator<T, Layout, N, M> iterator;
+    typedef MatrixIterator<const T, Layout, N, M> const_iterator;
 
     iterator begin() {
       return iterator(buffer, 0);
     }
     iterator end() {
-      return iterator(buffer + size, size);
+      return iterator(buffer, size);
     }
     const_iterator begin() const {
       return const_iterator(buffer, 0);
     }
     const_iterator end() const {
-      return const_iterator(buffer + size, size);
+      return const_iterator(buffer, size);
     }
     iterator at(size_t pos) {
-      return iterator(buffer + pos, pos);
+      return iterator(buffer, pos);
     }
     const_iterator at(size_t pos) const {
-      return const_iterator(buffer + pos, pos)
+      return const_iterator(buffer, pos);
     }
     iterator row_begin(size_t row_num) {
       return at(row_num * M);
@@ -57,15 +154,23 @@ namespace sm {
     const_iterator row_end(size_t row_num) const {
       return at(row_num * M + M);
     }
+  private:
+    static T* allocate() {
+      T* raw = new T[storage_size];
+      // Padding must stay zero for kernels working on the whole buffer
+      if (storage_size != size)
+        std::fill(raw, raw + storage_size, T(0));
+      return raw;
+    }
   public:
     MatrixBuff() {
-      buffer = new T[size];
+      buffer = allocate();
     }
 
     MatrixBuff(const MatrixBuff& MB) {
-      buffer = new T[size];
+      buffer = allocate();
       try {
-        std::copy(MB.begin(), MB.end(), begin());
+        std::copy(MB.buffer, MB.buffer + storage_size, buffer);
       }
       catch (...) {
         delete[] buffer;
@@ -73,17 +178,25 @@ namespace sm {
       }
     }
 
-    MatrixBuff(MatrixBuff<T, N, M>&& MB) {
+    MatrixBuff(MatrixBuff<T, N, M, Layout>&& MB) {
       buffer = MB.buffer;
       MB.buffer = nullptr;
     }
 
-    template<typename K>
-    MatrixBuff(const MatrixBuff<K, N, M>& MB) {
-      buffer = new T[size];
+    // Converts element type and layout. Elements are visited in
+    // row-major order on both sides, so any layouts can be mixed.
+    template<typename K, typename L>
+    MatrixBuff(const MatrixBuff<K, N, M, L>& MB) {
+      buffer = allocate();
       try {
-        std::transform(MB.begin(), MB.end(), begin(), 
-          [](const K& elem) { return static_cast<T>(elem); });
+        if (std::is_same<L, Layout>::value) {
+          std::transform(MB.buffer, MB.buffer + storage_size, buffer,
+            [](const K& elem) { return static_cast<T>(elem); });
+        }
+        else {
+          std::transform(MB.begin(), MB.end(), begin(),
+            [](const K& elem) { return static_cast<T>(elem); });
+        }
       }
       catch (...) {
         delete[] buffer;
@@ -93,7 +206,7 @@ namespace sm {
 
     MatrixBuff(const std::initializer_list<T>& i_list) {
       assert(i_list.size() <= size && "Too long initializer list");
-      buffer = new T[size];
+      buffer = allocate();
       try
       {
         std::copy(i_list.begin(), i_list.end(), begin());
@@ -108,7 +221,7 @@ namespace sm {
     MatrixBuff(const std::initializer_list<std::initializer_list<T>>& i_list)
     {
       assert(i_list.size() <= N && "Too many rows in initializer list");
-      buffer = new T[size];
+      buffer = allocate();
       unsigned pos = 0;
       try {
         for (auto row : i_list) {
@@ -139,31 +252,40 @@ namespace sm {
       return *this;
     }
 
+    // One-index access counts elements in row-major order for all layouts
     T get(size_t n) const {
       assert(n < size && "Out of the boundaries");
-      return buffer[n];
+      return buffer[Layout::position(n, N, M)];
     }
 
     T get(size_t n, size_t m) const {
       assert(n < N && m < M && "Out of the boundaries");
-      return buffer[n * M + m];
+      return buffer[Layout::index(n, m, N, M)];
     }
 
     void set(size_t n, const T& value) const {
       assert(n < size && "Out of the boundaries");
-      buffer[n] = value;
+      buffer[Layout::position(n, N, M)] = value;
     }
 
     void set(size_t n, size_t m, const T& value) const {
       assert(n < N && m < M && "Out of the boundaries");
-      buffer[n * M + m] = value;
+      buffer[Layout::index(n, m, N, M)] = value;
+    }
+
+    // Raw buffer in Layout order
+    T* data() {
+      return buffer;
+    }
+    const T* data() const {
+      return buffer;
     }
 
     T operator[](size_t n) const {
-      return buffer[n];
+      return buffer[Layout::position(n, N, M)];
     }
     T& operator[](size_t n) {
-      return buffer[n];
+      return buffer[Layout::position(n, N, M)];
     }
 
     ~MatrixBuff() {
@@ -171,22 +293,25 @@ namespace sm {
     }
   };
 
-  template <typename T, size_t N, size_t M>
-  class Matrix : public MatrixBuff<T, N, M>
+  template <typename T, size_t N, size_t M, typename Layout = RowMajor>
+  class Matrix : public MatrixBuff<T, N, M, Layout>
   {
-    template <typename, size_t, size_t>
+    template <typename, size_t, size_t, typename>
     friend class Matrix;
 
     // Evaluate matrix determinant by Gauss algorithm
     T gauss_det();
+
+    Matrix(T* raw, typename MatrixBuff<T, N, M, Layout>::adopt_tag tag)
+      : MatrixBuff<T, N, M, Layout>(raw, tag) {}
   public:
     Matrix() : MatrixBuff() {};
-    Matrix(const Matrix<T, N, M>& MB) : MatrixBuff(MB) {}
-    Matrix(Matrix<T, N, M>&& MB) : MatrixBuff(move(MB)) {}
+    Matrix(const Matrix<T, N, M, Layout>& MB) : MatrixBuff(MB) {}
+    Matrix(Matrix<T, N, M, Layout>&& MB) : MatrixBuff(move(MB)) {}
     Matrix(const std::initializer_list<T>& i_list) : MatrixBuff(i_list) {}
     Matrix(const std::initializer_list<std::initializer_list<T>>& i_list) : MatrixBuff(i_list) {}
-    template<typename K>
-    Matrix(const Matrix<K, N, M>& MB) : MatrixBuff(MB) {}
+    template<typename K, typename L>
+    Matrix(const Matrix<K, N, M, L>& MB) : MatrixBuff(MB) {}
 
     template<typename Arg>
     Matrix& operator=(Arg&& arg) {
@@ -200,43 +325,78 @@ namespace sm {
     }
 
     Matrix& operator+=(const Matrix& rv) {
-      for (unsigned i = 0; i < size; i++)
-        (*this)[i] += rv[i];
+      dispatch::kernels<T>().add(this->data(), rv.data(), this->data(), this->get_storage_size());
       return *this;
     }
 
     Matrix& operator-=(const Matrix& rv) {
-      for (unsigned i = 0; i < size; i++)
-        (*this)[i] -= rv[i];
+      dispatch::kernels<T>().sub(this->data(), rv.data(), this->data(), this->get_storage_size());
       return *this;
     }
 
     void row_transform(unsigned row1, unsigned row2, T factor) {
       assert(row1 < N && row2 < N && "Out of the boundaries");
       assert(row1 != row2 && "Row transformation persume different rows");
-      for (unsigned i = 0; i < M; i++) {
-        (*this)[row1*N + i] += factor * (*this)[row2*N + i];
+      if (std::is_same<Layout, RowMajor>::value) {
+        dispatch::kernels<T>().axpy(factor, this->data() + row2 * M, this->data() + row1 * M, M);
+      }
+      else {
+        for (size_t i = 0; i < M; i++)
+          this->set(row1, i, this->get(row1, i) + factor * this->get(row2, i));
       }
     }
 
+    // Sum of all elements
+    T sum() const {
+      return dispatch::kernels<T>().sum(this->data(), this->get_storage_size());
+    }
+
+    // Transposed matrix made by relabeling this buffer in the transposed
+    // layout, without copying. This matrix is left empty.
+    Matrix<T, M, N, typename Layout::transposed> relabel_transp() && {
+      typedef Matrix<T, M, N, typename Layout::transposed> Transposed;
+      return Transposed(this->release(), typename Transposed::adopt_tag());
+    }
+
     long double det() const;
   };
 
+  template<typename T, size_t N, size_t M, typename Layout>
+  Matrix<T, M, N, Layout> get_transp(const Matrix<T, N, M, Layout>& matrix) {
+    Matrix<T, M, N, Layout> tr_matrix;
+    for (size_t n = 0; n < N; n++)
+      for (size_t m = 0; m < M; m++)
+        tr_matrix.set(m, n, matrix.get(n, m));
+    return tr_matrix;
+  }
+
   template<typename T, size_t N, size_t M>
-  Matrix<T, M, N> get_transp(const Matrix<T, N, M> matrix) {
+  Matrix<T, M, N> get_transp(const Matrix<T, N, M>& matrix) {
     Matrix<T, M, N> tr_matrix;
-    for (size_t row_num = 0; row_num < N; row_num++) {
-      for (size_t pos1 = row_num * M, pos2 = row_num;
-        pos1 < matrix.get_size() && pos2 < tr_matrix.get_size();
-        ++pos1, pos2 += N) {
-        tr_matrix[pos2] = matrix[pos1];
-      }
-    }
+    dispatch::kernels<T>().transpose(matrix.data(), tr_matrix.data(), N, M);
     return tr_matrix;
   }
 
   template<typename T, size_t N, size_t M>
-  T Matrix<T, N, M>::gauss_det() {
+  Matrix<T, M, N, ColumnMajor> get_transp(const Matrix<T, N, M, ColumnMajor>& matrix) {
+    // Column-major N * M buffer is a row-major M * N one
+    Matrix<T, M, N, ColumnMajor> tr_matrix;
+    dispatch::kernels<T>().transpose(matrix.data(), tr_matrix.data(), M, N);
+    return tr_matrix;
+  }
+
+  // Transposition without copying, see Matrix::relabel_transp
+  template<typename T, size_t N, size_t M, typename Layout>
+  Matrix<T, M, N, typename Layout::transposed> relabel_transp(Matrix<T, N, M, Layout>&& matrix) {
+    return std::move(matrix).relabel_transp();
+  }
+
+  template<typename T, size_t N, size_t M, typename Layout>
+  T Matrix<T, N, M, Layout>::gauss_det() {
+    // Rows are passed to kernels as contiguous arrays, det() converts
+    // other layouts before the call
+    static_assert(std::is_same<Layout, RowMajor>::value,
+      "Gauss determinant requires row-major layout");
     T det = 1;
 
     std::array<uint16_t, M> excluded_columns = { 0 };
@@ -244,21 +404,20 @@ namespace sm {
     // Row position of the last diagonal element, affect element parity
     size_t split_point = 0;
 
+    const auto& kernels = dispatch::kernels<T>();
+
     // For each row in matrix
     for (size_t row_num = 0; row_num < N; row_num++) {
-      auto row_begin = this->at(row_num * M);
-      auto row_end = this->at(row_num * M + M);
+      T* row = this->data() + row_num * M;
 
       // Search for abs_max element in row
-      auto diagonal_elem = std::max_element(row_begin, row_end,
-        [](T left, T right) {return std::abs(left) < std::abs(right); });
+      size_t diag_row_pos = kernels.max_abs(row, M);
+      T diagonal_elem = row[diag_row_pos];
 
       // Return 0, if all element in row equal 0
-      if (*diagonal_elem == 0)
+      if (diagonal_elem == 0)
         return 0;
 
-      size_t diag_row_pos = diagonal_elem.get_pos() % M;
-
       // Evaluate parity of diagonal element
       size_t diag_elem_parity = accumulate(excluded_columns.begin() + diag_row_pos,
         excluded_columns.end(), 0);
@@ -266,15 +425,14 @@ namespace sm {
 
       // Mult determinant by diagonal elem considering parity
       if (diag_elem_parity % 2 == 0) {
-        det *= *diagonal_elem;
+        det *= diagonal_elem;
       }
       else {
-        det *= (-1) * (*diagonal_elem);
+        det *= (-1) * diagonal_elem;
       }
 
       // Divide all elems in row by diagonal
-      std::transform(row_begin, row_end, row_begin,
-        [val = *diagonal_elem](const T& elem) { return elem / val; });
+      kernels.scale(row, 1 / diagonal_elem, row, M);
 
       // Substract this row from the underlying rows to get zeros in column
       for (size_t row_num_next = row_num + 1; row_num_next < N; row_num_next++) {
@@ -290,74 +448,106 @@ namespace sm {
     return det;
   }
 
-  template<typename T, size_t N, size_t M>
-  long double Matrix<T, N, M>::det() const {
+  template<typename T, size_t N, size_t M, typename Layout>
+  long double Matrix<T, N, M, Layout>::det() const {
     static_assert(N == M,
       "Determinant can be evaluated only for square matrixes");
     static_assert(std::is_arithmetic<T>::value,
       "Determinant can be evaluated only for numerical matrixes ");
 
-    Matrix<long double, N, M> tmp = Matrix(*this);
+    Matrix<detail::det_type, N, M> tmp = Matrix(*this);
     return static_cast<long double>(tmp.gauss_det());
   }
 
-  template<typename T, size_t N, size_t M>
-  inline bool operator==(const Matrix<T, N, M>& matrix1, const Matrix<T, N, M>& matrix2) {
+  template<typename T, size_t N, size_t M, typename Layout>
+  inline bool operator==(const Matrix<T, N, M, Layout>& matrix1, const Matrix<T, N, M, Layout>& matrix2) {
     for (size_t i = 0; i < matrix1.get_size(); i++)
       if (matrix1[i] != matrix2[i])
         return false;
     return true;
   }
 
-  template<typename T, size_t N, size_t M>
-  inline Matrix<T, N, M> operator+(const Matrix<T, N, M>& matrix1, const Matrix<T, N, M>& matrix2) {
-    Matrix<T, N, M> m;
-    for (unsigned i = 0; i < matrix1.get_size(); i++)
-      m[i] = matrix1[i] + matrix2[i];
+  template<typename T, size_t N, size_t M, typename Layout>
+  inline Matrix<T, N, M, Layout> operator+(const Matrix<T, N, M, Layout>& matrix1,
+    const Matrix<T, N, M, Layout>& matrix2) {
+    Matrix<T, N, M, Layout> m;
+    dispatch::kernels<T>().add(matrix1.data(), matrix2.data(), m.data(), m.get_storage_size());
     return m;
   }
 
-  template<typename T, size_t N, size_t M>
-  inline Matrix<T, N, M> operator-(const Matrix<T, N, M>& matrix1, const Matrix<T, N, M>& matrix2) {
-    Matrix<T, N, M> m;
-    for (unsigned i = 0; i < matrix1.get_size(); i++)
-      m[i] = matrix1[i] - matrix2[i];
+  template<typename T, size_t N, size_t M, typename Layout>
+  inline Matrix<T, N, M, Layout> operator-(const Matrix<T, N, M, Layout>& matrix1,
+    const Matrix<T, N, M, Layout>& matrix2) {
+    Matrix<T, N, M, Layout> m;
+    dispatch::kernels<T>().sub(matrix1.data(), matrix2.data(), m.data(), m.get_storage_size());
     return m;
   }
 
-  template<typename T, size_t N, size_t M>
-  inline Matrix<T, N, M> operator*(const T& value, const Matrix<T, N, M>& matrix) {
-    Matrix<T, N, M> m;
-    for (unsigned i = 0; i < get_size(); i++)
-      m[i] = matrix[i] * value;
+  template<typename T, size_t N, size_t M, typename Layout>
+  inline Matrix<T, N, M, Layout> operator*(const T& value, const Matrix<T, N, M, Layout>& matrix) {
+    Matrix<T, N, M, Layout> m;
+    dispatch::kernels<T>().scale(matrix.data(), value, m.data(), m.get_storage_size());
     return m;
   }
 
-  template<typename T, size_t N, size_t M>
-  inline Matrix<T, N, M> operator*(const Matrix<T, N, M>& matrix, const T& value) {
-    Matrix<T, N, M> m;
-    for (unsigned i = 0; i < get_size(); i++)
-      m[i] = value * matrix[i];
+  template<typename T, size_t N, size_t M, typename Layout>
+  inline Matrix<T, N, M, Layout> operator*(const Matrix<T, N, M, Layout>& matrix, const T& value) {
+    Matrix<T, N, M, Layout> m;
+    dispatch::kernels<T>().scale(matrix.data(), value, m.data(), m.get_storage_size());
     return m;
   }
 
+  // Mixed layouts are converted to row-major first
+  template<typename T, size_t N, size_t M, size_t K, typename Layout1, typename Layout2>
+  inline Matrix<T, N, K> operator*(const Matrix<T, N, M, Layout1>& matrix1,
+    const Matrix<T, M, K, Layout2>& matrix2) {
+    return Matrix<T, N, M>(matrix1) * Matrix<T, M, K>(matrix2);
+  }
+
   template<typename T, size_t N, size_t M, size_t K>
   inline Matrix<T, N, K> operator*(const Matrix<T, N, M>& matrix1, const Matrix<T, M, K>& matrix2) {
     Matrix<T, N, K> m;
-    Matrix<T, K, M> tr_matrix2 = get_transp(matrix2);
-    for (size_t pos = 0; pos < m.get_size(); pos++) {
-      m[pos] = 0;
-      size_t row_num1 = pos / K;
-      size_t row_num2 = pos % K;
-      for (size_t pos2 = 0; pos2 < M; pos2++) {
-        m[pos] += matrix1.get(row_num1, pos2) * tr_matrix2.get(row_num2, pos2);
+    dispatch::kernels<T>().mult(matrix1.data(), matrix2.data(), m.data(), N, M, K);
+    return m;
+  }
+
+  // Columns of column-major operand are contiguous, every element of
+  // the result is a dot product of two sequential arrays
+  template<typename T, size_t N, size_t M, size_t K>
+  inline Matrix<T, N, K> operator*(const Matrix<T, N, M>& matrix1,
+    const Matrix<T, M, K, ColumnMajor>& matrix2) {
+    Matrix<T, N, K> m;
+    const auto& kernels = dispatch::kernels<T>();
+    for (size_t row = 0; row < N; row++)
+      for (size_t col = 0; col < K; col++)
+        m[row * K + col] = kernels.dot(matrix1.data() + row * M, matrix2.data() + col * M, M);
+    return m;
+  }
+
+  // Tiles are contiguous B * B row-major blocks, result tiles are
+  // accumulated from tile products. Zero padding doesn't affect the sums.
+  template<typename T, size_t N, size_t M, size_t K, size_t B>
+  inline Matrix<T, N, K, Tiled<B>> operator*(const Matrix<T, N, M, Tiled<B>>& matrix1,
+    const Matrix<T, M, K, Tiled<B>>& matrix2) {
+    typedef Tiled<B> L;
+    Matrix<T, N, K, Tiled<B>> m;
+    std::fill(m.data(), m.data() + m.get_storage_size(), T(0));
+    const auto& kernels = dispatch::kernels<T>();
+    for (size_t tile_row = 0; tile_row < L::tiles(N); tile_row++) {
+      for (size_t tile_inner = 0; tile_inner < L::tiles(M); tile_inner++) {
+        const T* a = matrix1.data() + L::index(tile_row * B, tile_inner * B, N, M);
+        for (size_t tile_col = 0; tile_col < L::tiles(K); tile_col++) {
+          const T* b = matrix2.data() + L::index(tile_inner * B, tile_col * B, M, K);
+          T* c = m.data() + L::index(tile_row * B, tile_col * B, N, K);
+          kernels.mult_add(a, b, c, B, B, B);
+        }
       }
     }
     return m;
   }
 
-  template<typename T, size_t N, size_t M>
-  inline std::ostream& operator<<(std::ostream& os, const Matrix<T, N, M>& matrix) {
+  template<typename T, size_t N, size_t M, typename Layout>
+  inline std::ostream& operator<<(std::ostream& os, const Matrix<T, N, M, Layout>& matrix) {
     os << "<MATRIX " << N << "*" << M << ">" << '\n';
     for (unsigned i = 0; i < matrix.get_size(); i++) {
       os << matrix[i];
@@ -371,12 +561,13 @@ namespace sm {
   }
 
 
-  template<typename T>
+  // Visits elements in row-major order whatever the storage layout is
+  template<typename T, typename Layout, size_t N, size_t M>
   class MatrixIterator : public std::iterator<std::forward_iterator_tag, T>
   {
-    template<typename, size_t, size_t>
-    friend class MatrixBuffer;
-    template<typename, size_t, size_t>
+    template<typename, size_t, size_t, typename>
+    friend class MatrixBuff;
+    template<typename, size_t, size_t, typename>
     friend class Matrix;
   public:
     MatrixIterator(T* p, size_t pos);
@@ -391,34 +582,34 @@ namespace sm {
       return pos;
     }
   private:
+    // Beginning of the buffer
     T* p;
     size_t pos;
   };
 
-  template<typename T>
-  MatrixIterator<T>::MatrixIterator(T* p, size_t pos) : p(p), pos(pos) {}
+  template<typename T, typename Layout, size_t N, size_t M>
+  MatrixIterator<T, Layout, N, M>::MatrixIterator(T* p, size_t pos) : p(p), pos(pos) {}
 
-  template<typename T>
-  MatrixIterator<T>::MatrixIterator(const MatrixIterator &it) : p(it.p), pos(it.pos) {}
+  template<typename T, typename Layout, size_t N, size_t M>
+  MatrixIterator<T, Layout, N, M>::MatrixIterator(const MatrixIterator &it) : p(it.p), pos(it.pos) {}
 
-  template<typename T>
-  bool MatrixIterator<T>::operator!=(MatrixIterator const& other) const {
-    return p != other.p;
+  template<typename T, typename Layout, size_t N, size_t M>
+  bool MatrixIterator<T, Layout, N, M>::operator!=(MatrixIterator const& other) const {
+    return p != other.p || pos != other.pos;
   }
 
-  template<typename T>
-  bool MatrixIterator<T>::operator==(MatrixIterator const& other) const {
-    return p == other.p;
+  template<typename T, typename Layout, size_t N, size_t M>
+  bool MatrixIterator<T, Layout, N, M>::operator==(MatrixIterator const& other) const {
+    return p == other.p && pos == other.pos;
   }
 
-  template<typename T>
-  T& MatrixIterator<T>::operator*() const {
-    return *p;
+  template<typename T, typename Layout, size_t N, size_t M>
+  T& MatrixIterator<T, Layout, N, M>::operator*() const {
+    return p[Layout::position(pos, N, M)];
   }
 
-  template<typename T>
-  MatrixIterator<T>& MatrixIterator<T>::operator++() {
-    ++p;
+  template<typename T, typename Layout, size_t N, size_t M>
+  MatrixIterator<T, Layout, N, M>& MatrixIterator<T, Layout, N, M>::operator++() {
     ++pos;
     return *this;
   }
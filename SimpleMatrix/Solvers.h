@@ -0,0 +1,427 @@
+﻿#pragma once
+#include <vector>
+#include <cmath>
+#include <functional>
+
+#include "Matrix.h"
+
+namespace sm {
+
+  // Column vector used by the iterative solvers
+  template <typename T, size_t N>
+  using Vector = Matrix<T, N, 1>;
+
+  // Solver settings. The solution vector passed to a solver is used as
+  // the initial guess, so a previous solution can be reused as warm start.
+  struct SolverParams {
+    size_t max_iterations = 1000;
+    // Stop when ||b - Ax|| / ||b|| < tolerance
+    double tolerance = 1e-8;
+    // Krylov subspace size between GMRES restarts
+    size_t restart = 30;
+    // Called after each iteration with iteration number and relative residual
+    std::function<void(size_t, double)> monitor;
+  };
+
+  struct SolverReport {
+    size_t iterations = 0;
+    double residual = 0;
+    bool converged = false;
+  };
+
+  // Vector kernels. Vectors are split into chunks which OpenMP pragmas
+  // spread between threads when /openmp is enabled, every chunk is
+  // processed by a SIMD kernel from the dispatch table.
+  // OpenMP 2.0 requires signed loop counters.
+
+  const size_t solver_chunk_size = 4096;
+
+  template<size_t N>
+  constexpr long long chunk_count() {
+    return static_cast<long long>((N + solver_chunk_size - 1) / solver_chunk_size);
+  }
+
+  template<size_t N>
+  inline size_t chunk_length(long long chunk) {
+    return std::min(solver_chunk_size, N - static_cast<size_t>(chunk) * solver_chunk_size);
+  }
+
+  template<typename T, size_t N>
+  T dot(const Vector<T, N>& x, const Vector<T, N>& y) {
+    const auto& kernels = dispatch::kernels<T>();
+    const long long chunks = chunk_count<N>();
+    T result = 0;
+#pragma omp parallel for reduction(+:result) if(chunks > 1)
+    for (long long chunk = 0; chunk < chunks; chunk++) {
+      const size_t begin = static_cast<size_t>(chunk) * solver_chunk_size;
+      result += kernels.dot(x.data() + begin, y.data() + begin, chunk_length<N>(chunk));
+    }
+    return result;
+  }
+
+  template<typename T, size_t N>
+  T norm(const Vector<T, N>& x) {
+    return std::sqrt(dot(x, x));
+  }
+
+  // y = y + a * x
+  template<typename T, size_t N>
+  void axpy(T a, const Vector<T, N>& x, Vector<T, N>& y) {
+    const auto& kernels = dispatch::kernels<T>();
+    const long long chunks = chunk_count<N>();
+#pragma omp parallel for if(chunks > 1)
+    for (long long chunk = 0; chunk < chunks; chunk++) {
+      const size_t begin = static_cast<size_t>(chunk) * solver_chunk_size;
+      kernels.axpy(a, x.data() + begin, y.data() + begin, chunk_length<N>(chunk));
+    }
+  }
+
+  // y = x + b * y
+  template<typename T, size_t N>
+  void xpby(const Vector<T, N>& x, T b, Vector<T, N>& y) {
+    const auto& kernels = dispatch::kernels<T>();
+    const long long chunks = chunk_count<N>();
+#pragma omp parallel for if(chunks > 1)
+    for (long long chunk = 0; chunk < chunks; chunk++) {
+      const size_t begin = static_cast<size_t>(chunk) * solver_chunk_size;
+      const size_t length = chunk_length<N>(chunk);
+      // Chunk stays in cache between the two passes
+      kernels.scale(y.data() + begin, b, y.data() + begin, length);
+      kernels.add(x.data() + begin, y.data() + begin, y.data() + begin, length);
+    }
+  }
+
+  // y = a * x
+  template<typename T, size_t N>
+  void scale(T a, const Vector<T, N>& x, Vector<T, N>& y) {
+    const auto& kernels = dispatch::kernels<T>();
+    const long long chunks = chunk_count<N>();
+#pragma omp parallel for if(chunks > 1)
+    for (long long chunk = 0; chunk < chunks; chunk++) {
+      const size_t begin = static_cast<size_t>(chunk) * solver_chunk_size;
+      kernels.scale(x.data() + begin, a, y.data() + begin, chunk_length<N>(chunk));
+    }
+  }
+
+  // y = A * x, without allocating the result. Other layouts than
+  // row-major and column-major go element by element.
+  template<typename T, size_t N, size_t M, typename Layout>
+  void mult(const Matrix<T, N, M, Layout>& A, const Vector<T, M>& x, Vector<T, N>& y) {
+    const long long rows = static_cast<long long>(N);
+#pragma omp parallel for
+    for (long long row = 0; row < rows; row++) {
+      T value = T(0);
+      for (size_t col = 0; col < M; col++)
+        value += A.get(static_cast<size_t>(row), col) * x[col];
+      y[static_cast<size_t>(row)] = value;
+    }
+  }
+
+  template<typename T, size_t N, size_t M>
+  void mult(const Matrix<T, N, M>& A, const Vector<T, M>& x, Vector<T, N>& y) {
+    const auto& kernels = dispatch::kernels<T>();
+    const long long rows = static_cast<long long>(N);
+#pragma omp parallel for
+    for (long long row = 0; row < rows; row++) {
+      const size_t row_pos = static_cast<size_t>(row) * M;
+      y[static_cast<size_t>(row)] = kernels.dot(A.data() + row_pos, x.data(), M);
+    }
+  }
+
+  // Column-major: y is accumulated column by column, every thread
+  // takes its own chunk of rows
+  template<typename T, size_t N, size_t M>
+  void mult(const Matrix<T, N, M, ColumnMajor>& A, const Vector<T, M>& x, Vector<T, N>& y) {
+    const auto& kernels = dispatch::kernels<T>();
+    const long long chunks = chunk_count<N>();
+#pragma omp parallel for if(chunks > 1)
+    for (long long chunk = 0; chunk < chunks; chunk++) {
+      const size_t begin = static_cast<size_t>(chunk) * solver_chunk_size;
+      const size_t length = chunk_length<N>(chunk);
+      std::fill(y.data() + begin, y.data() + begin + length, T(0));
+      for (size_t col = 0; col < M; col++)
+        kernels.axpy(x[col], A.data() + col * N + begin, y.data() + begin, length);
+    }
+  }
+
+  // Operators and preconditioners are any objects with
+  // void apply(const Vector<T, N>& x, Vector<T, N>& y) const
+  template<typename Op, typename T, size_t N>
+  void apply(const Op& op, const Vector<T, N>& x, Vector<T, N>& y) {
+    op.apply(x, y);
+  }
+
+  template<typename T, size_t N, typename Layout>
+  void apply(const Matrix<T, N, N, Layout>& A, const Vector<T, N>& x, Vector<T, N>& y) {
+    mult(A, x, y);
+  }
+
+  template<typename T, size_t N>
+  class IdentityPreconditioner {
+  public:
+    void apply(const Vector<T, N>& r, Vector<T, N>& z) const {
+      std::copy(r.begin(), r.end(), z.begin());
+    }
+  };
+
+  template<typename T, size_t N>
+  class JacobiPreconditioner {
+    Vector<T, N> inv_diag;
+  public:
+    JacobiPreconditioner(const Matrix<T, N, N>& A) {
+      for (size_t i = 0; i < N; i++) {
+        assert(A.get(i, i) != 0 && "Zero on the diagonal");
+        inv_diag[i] = 1 / A.get(i, i);
+      }
+    }
+
+    void apply(const Vector<T, N>& r, Vector<T, N>& z) const {
+      const long long size = static_cast<long long>(N);
+#pragma omp parallel for if(N > solver_chunk_size)
+      for (long long i = 0; i < size; i++)
+        z[i] = inv_diag[i] * r[i];
+    }
+  };
+
+  // Incomplete LU factorization with the sparsity pattern of A.
+  // L (unit diagonal) and U are stored together in one matrix.
+  template<typename T, size_t N>
+  class ILU0Preconditioner {
+    Matrix<T, N, N> lu;
+  public:
+    ILU0Preconditioner(const Matrix<T, N, N>& A) : lu(A) {
+      for (size_t i = 1; i < N; i++) {
+        for (size_t k = 0; k < i; k++) {
+          if (lu[i * N + k] == 0)
+            continue;
+          assert(lu[k * N + k] != 0 && "Zero pivot in ILU(0)");
+          T factor = lu[i * N + k] / lu[k * N + k];
+          lu[i * N + k] = factor;
+          // Update only elements which are nonzero in A
+          for (size_t j = k + 1; j < N; j++) {
+            if (A[i * N + j] != 0)
+              lu[i * N + j] -= factor * lu[k * N + j];
+          }
+        }
+      }
+    }
+
+    void apply(const Vector<T, N>& r, Vector<T, N>& z) const {
+      // Forward substitution L * y = r
+      for (size_t i = 0; i < N; i++) {
+        T sum = r[i];
+        for (size_t j = 0; j < i; j++)
+          sum -= lu[i * N + j] * z[j];
+        z[i] = sum;
+      }
+      // Backward substitution U * z = y
+      for (size_t i = N; i-- > 0;) {
+        T sum = z[i];
+        for (size_t j = i + 1; j < N; j++)
+          sum -= lu[i * N + j] * z[j];
+        z[i] = sum / lu[i * N + i];
+      }
+    }
+  };
+
+  // Report residual and check it against tolerance
+  // notify is false when the residual of this iteration was already reported
+  inline bool check_convergence(SolverReport& report, const SolverParams& params,
+    double residual, bool notify = true) {
+    report.residual = residual;
+    if (notify && params.monitor)
+      params.monitor(report.iterations, residual);
+    report.converged = residual < params.tolerance;
+    return report.converged;
+  }
+
+  // Preconditioned conjugate gradient for symmetric positive definite A
+  template<typename Op, typename T, size_t N, typename Prec = IdentityPreconditioner<T, N>>
+  SolverReport cg(const Op& A, const Vector<T, N>& b, Vector<T, N>& x,
+    const SolverParams& params = SolverParams(), const Prec& prec = Prec()) {
+    SolverReport report;
+    Vector<T, N> r, z, p, Ap;
+
+    double b_norm = static_cast<double>(norm(b));
+    if (b_norm == 0)
+      b_norm = 1;
+
+    // r = b - A * x
+    apply(A, x, r);
+    xpby(b, T(-1), r);
+    if (check_convergence(report, params, norm(r) / b_norm))
+      return report;
+
+    apply(prec, r, z);
+    std::copy(z.begin(), z.end(), p.begin());
+    T rz = dot(r, z);
+
+    while (report.iterations < params.max_iterations) {
+      report.iterations++;
+      apply(A, p, Ap);
+      T alpha = rz / dot(p, Ap);
+      axpy(alpha, p, x);
+      axpy(-alpha, Ap, r);
+      if (check_convergence(report, params, norm(r) / b_norm))
+        break;
+
+      apply(prec, r, z);
+      T rz_next = dot(r, z);
+      xpby(z, rz_next / rz, p);
+      rz = rz_next;
+    }
+    return report;
+  }
+
+  // Right-preconditioned BiCGSTAB for general nonsymmetric A
+  template<typename Op, typename T, size_t N, typename Prec = IdentityPreconditioner<T, N>>
+  SolverReport bicgstab(const Op& A, const Vector<T, N>& b, Vector<T, N>& x,
+    const SolverParams& params = SolverParams(), const Prec& prec = Prec()) {
+    SolverReport report;
+    Vector<T, N> r, r_hat, p, v, s, t, y, z;
+
+    double b_norm = static_cast<double>(norm(b));
+    if (b_norm == 0)
+      b_norm = 1;
+
+    apply(A, x, r);
+    xpby(b, T(-1), r);
+    if (check_convergence(report, params, norm(r) / b_norm))
+      return report;
+
+    std::copy(r.begin(), r.end(), r_hat.begin());
+    std::fill(p.begin(), p.end(), T(0));
+    std::fill(v.begin(), v.end(), T(0));
+    T rho = 1, alpha = 1, omega = 1;
+
+    while (report.iterations < params.max_iterations) {
+      report.iterations++;
+      T rho_next = dot(r_hat, r);
+      // Breakdown, r is orthogonal to the shadow residual
+      if (rho_next == 0)
+        break;
+
+      // p = r + beta * (p - omega * v)
+      T beta = (rho_next / rho) * (alpha / omega);
+      axpy(-omega, v, p);
+      xpby(r, beta, p);
+
+      apply(prec, p, y);
+      apply(A, y, v);
+      alpha = rho_next / dot(r_hat, v);
+
+      // s = r - alpha * v
+      std::copy(r.begin(), r.end(), s.begin());
+      axpy(-alpha, v, s);
+      if (norm(s) / b_norm < params.tolerance) {
+        axpy(alpha, y, x);
+        check_convergence(report, params, norm(s) / b_norm);
+        break;
+      }
+
+      apply(prec, s, z);
+      apply(A, z, t);
+      T tt = dot(t, t);
+      omega = tt == 0 ? T(0) : dot(t, s) / tt;
+
+      axpy(alpha, y, x);
+      axpy(omega, z, x);
+      // r = s - omega * t
+      std::copy(s.begin(), s.end(), r.begin());
+      axpy(-omega, t, r);
+      rho = rho_next;
+
+      if (check_convergence(report, params, norm(r) / b_norm) || omega == 0)
+        break;
+    }
+    return report;
+  }
+
+  // Right-preconditioned restarted GMRES(restart) for general A
+  template<typename Op, typename T, size_t N, typename Prec = IdentityPreconditioner<T, N>>
+  SolverReport gmres(const Op& A, const Vector<T, N>& b, Vector<T, N>& x,
+    const SolverParams& params = SolverParams(), const Prec& prec = Prec()) {
+    SolverReport report;
+    const size_t m = std::max<size_t>(1, std::min(params.restart, N));
+
+    // Krylov basis, Hessenberg matrix (stored by columns) and Givens rotations
+    std::vector<Vector<T, N>> basis(m + 1);
+    std::vector<T> hessenberg((m + 1) * m);
+    std::vector<T> cs(m), sn(m), g(m + 1), y(m);
+    Vector<T, N> r, w, z;
+
+    double b_norm = static_cast<double>(norm(b));
+    if (b_norm == 0)
+      b_norm = 1;
+
+    auto H = [&hessenberg, m](size_t i, size_t j) -> T& {
+      return hessenberg[j * (m + 1) + i];
+    };
+
+    while (true) {
+      apply(A, x, r);
+      xpby(b, T(-1), r);
+      T beta = norm(r);
+      // After a restart the true residual replaces the estimate of the
+      // inner loop for the same iteration, monitor has seen it already
+      if (check_convergence(report, params, beta / b_norm, report.iterations == 0)
+        || report.iterations >= params.max_iterations)
+        break;
+
+      scale(1 / beta, r, basis[0]);
+      std::fill(g.begin(), g.end(), T(0));
+      g[0] = beta;
+
+      size_t used = 0;
+      while (used < m && report.iterations < params.max_iterations) {
+        const size_t j = used++;
+        report.iterations++;
+
+        // Arnoldi step with modified Gram-Schmidt
+        apply(prec, basis[j], z);
+        apply(A, z, w);
+        for (size_t i = 0; i <= j; i++) {
+          H(i, j) = dot(w, basis[i]);
+          axpy(-H(i, j), basis[i], w);
+        }
+        H(j + 1, j) = norm(w);
+        bool happy_breakdown = H(j + 1, j) == 0;
+        if (!happy_breakdown)
+          scale(1 / H(j + 1, j), w, basis[j + 1]);
+
+        // Apply previous rotations to the new column
+        for (size_t i = 0; i < j; i++) {
+          T tmp = cs[i] * H(i, j) + sn[i] * H(i + 1, j);
+          H(i + 1, j) = -sn[i] * H(i, j) + cs[i] * H(i + 1, j);
+          H(i, j) = tmp;
+        }
+        // Eliminate subdiagonal element with a new rotation
+        T denom = std::sqrt(H(j, j) * H(j, j) + H(j + 1, j) * H(j + 1, j));
+        cs[j] = H(j, j) / denom;
+        sn[j] = H(j + 1, j) / denom;
+        H(j, j) = denom;
+        H(j + 1, j) = 0;
+        g[j + 1] = -sn[j] * g[j];
+        g[j] = cs[j] * g[j];
+
+        if (check_convergence(report, params, std::abs(g[j + 1]) / b_norm)
+          || happy_breakdown)
+          break;
+      }
+
+      // Solve upper triangular system H * y = g and update x += M^-1 * V * y
+      for (size_t i = used; i-- > 0;) {
+        T sum = g[i];
+        for (size_t k = i + 1; k < used; k++)
+          sum -= H(i, k) * y[k];
+        y[i] = sum / H(i, i);
+      }
+      std::fill(w.begin(), w.end(), T(0));
+      for (size_t i = 0; i < used; i++)
+        axpy(y[i], basis[i], w);
+      apply(prec, w, z);
+      axpy(T(1), z, x);
+    }
+    return report;
+  }
+}
@@ -0,0 +1,326 @@
+﻿#pragma once
+#include <vector>
+#include <cmath>
+
+#include "Matrix.h"
+
+namespace sm {
+
+  // Symmetric matrix, only the lower triangle is stored, row by row:
+  // element (n, m), m <= n, is at n * (n + 1) / 2 + m
+  template<typename T, size_t N>
+  class SymmetricMatrix {
+    std::vector<T> packed;
+
+    static size_t index(size_t n, size_t m) {
+      return n * (n + 1) / 2 + m;
+    }
+  public:
+    static constexpr size_t get_storage_size() {
+      return N * (N + 1) / 2;
+    }
+
+    // Stored part of row n, columns 0..n
+    const T* row_data(size_t n) const {
+      return packed.data() + index(n, 0);
+    }
+
+    SymmetricMatrix() : packed(get_storage_size()) {}
+
+    // Lower triangle of matrix is used, upper one is ignored
+    template<typename Layout>
+    SymmetricMatrix(const Matrix<T, N, N, Layout>& matrix) : packed(get_storage_size()) {
+      for (size_t n = 0; n < N; n++)
+        for (size_t m = 0; m <= n; m++)
+          packed[index(n, m)] = matrix.get(n, m);
+    }
+
+    T get(size_t n, size_t m) const {
+      assert(n < N && m < N && "Out of the boundaries");
+      return n >= m ? packed[index(n, m)] : packed[index(m, n)];
+    }
+
+    void set(size_t n, size_t m, const T& value) {
+      assert(n < N && m < N && "Out of the boundaries");
+      packed[n >= m ? index(n, m) : index(m, n)] = value;
+    }
+
+    Matrix<T, N, N> to_matrix() const {
+      Matrix<T, N, N> matrix;
+      for (size_t n = 0; n < N; n++)
+        for (size_t m = 0; m < N; m++)
+          matrix.set(n, m, get(n, m));
+      return matrix;
+    }
+
+    // y = A * x
+    void apply(const Matrix<T, N, 1>& x, Matrix<T, N, 1>& y) const {
+      const auto& kernels = dispatch::kernels<T>();
+      std::fill(y.begin(), y.end(), T(0));
+      for (size_t n = 0; n < N; n++) {
+        const T* row = packed.data() + index(n, 0);
+        // Stored row n gives y[n] for the lower part and, by symmetry,
+        // the contribution of x[n] to y[0..n) for the upper part
+        y[n] += kernels.dot(row, x.data(), n + 1);
+        kernels.axpy(x[n], row, y.data(), n);
+      }
+    }
+  };
+
+  // Rows of the result are sums of rows of matrix scaled by elements of A
+  template<typename T, size_t N, size_t K>
+  Matrix<T, N, K> operator*(const SymmetricMatrix<T, N>& A, const Matrix<T, N, K>& matrix) {
+    Matrix<T, N, K> m;
+    std::fill(m.begin(), m.end(), T(0));
+    const auto& kernels = dispatch::kernels<T>();
+    for (size_t n = 0; n < N; n++) {
+      const T* row = A.row_data(n);
+      for (size_t pos = 0; pos <= n; pos++) {
+        const T value = row[pos];
+        kernels.axpy(value, matrix.data() + pos * K, m.data() + n * K, K);
+        if (pos != n)
+          kernels.axpy(value, matrix.data() + n * K, m.data() + pos * K, K);
+      }
+    }
+    return m;
+  }
+
+  enum class Triangle { lower, upper };
+
+  // Triangular matrix, only the nonzero triangle is stored, row by row
+  template<typename T, size_t N, Triangle Uplo = Triangle::lower>
+  class TriangularMatrix {
+    std::vector<T> packed;
+
+    static size_t index(size_t n, size_t m) {
+      if (Uplo == Triangle::lower)
+        return n * (n + 1) / 2 + m;
+      // Row n of upper triangle starts after rows of length N, N - 1, ...
+      return n * N - n * (n - 1) / 2 + (m - n);
+    }
+    static bool in_triangle(size_t n, size_t m) {
+      return Uplo == Triangle::lower ? m <= n : m >= n;
+    }
+  public:
+    static constexpr size_t get_storage_size() {
+      return N * (N + 1) / 2;
+    }
+
+    // Columns of the stored part of row n
+    static size_t row_first(size_t n) {
+      return Uplo == Triangle::lower ? 0 : n;
+    }
+    static size_t row_last(size_t n) {
+      return Uplo == Triangle::lower ? n : N - 1;
+    }
+    const T* row_data(size_t n) const {
+      return packed.data() + index(n, row_first(n));
+    }
+
+    TriangularMatrix() : packed(get_storage_size()) {}
+
+    // Elements outside of the triangle are ignored
+    template<typename Layout>
+    TriangularMatrix(const Matrix<T, N, N, Layout>& matrix) : packed(get_storage_size()) {
+      for (size_t n = 0; n < N; n++)
+        for (size_t m = row_first(n); m <= row_last(n); m++)
+          packed[index(n, m)] = matrix.get(n, m);
+    }
+
+    T get(size_t n, size_t m) const {
+      assert(n < N && m < N && "Out of the boundaries");
+      return in_triangle(n, m) ? packed[index(n, m)] : T(0);
+    }
+
+    void set(size_t n, size_t m, const T& value) {
+      assert(n < N && m < N && "Out of the boundaries");
+      assert(in_triangle(n, m) && "Element is outside of the triangle");
+      packed[index(n, m)] = value;
+    }
+
+    Matrix<T, N, N> to_matrix() const {
+      Matrix<T, N, N> matrix;
+      for (size_t n = 0; n < N; n++)
+        for (size_t m = 0; m < N; m++)
+          matrix.set(n, m, get(n, m));
+      return matrix;
+    }
+
+    // y = A * x
+    void apply(const Matrix<T, N, 1>& x, Matrix<T, N, 1>& y) const {
+      const auto& kernels = dispatch::kernels<T>();
+      for (size_t n = 0; n < N; n++) {
+        const size_t first = row_first(n);
+        y[n] = kernels.dot(packed.data() + index(n, first), x.data() + first,
+          row_last(n) - first + 1);
+      }
+    }
+
+    // Solve A * X = B by forward or backward substitution
+    template<size_t K>
+    Matrix<T, N, K> solve(const Matrix<T, N, K>& B) const {
+      Matrix<T, N, K> X = B;
+      const auto& kernels = dispatch::kernels<T>();
+      for (size_t step = 0; step < N; step++) {
+        const size_t n = Uplo == Triangle::lower ? step : N - 1 - step;
+        T* x_row = X.data() + n * K;
+        // Subtract already found rows of X
+        for (size_t m = row_first(n); m <= row_last(n); m++) {
+          if (m != n)
+            kernels.axpy(-packed[index(n, m)], X.data() + m * K, x_row, K);
+        }
+        const T diagonal = packed[index(n, n)];
+        assert(diagonal != 0 && "Singular triangular matrix");
+        kernels.scale(x_row, 1 / diagonal, x_row, K);
+      }
+      return X;
+    }
+
+    // Product of diagonal elements
+    long double det() const {
+      long double det = 1;
+      for (size_t n = 0; n < N; n++)
+        det *= packed[index(n, n)];
+      return det;
+    }
+  };
+
+  template<typename T, size_t N, size_t K, Triangle Uplo>
+  Matrix<T, N, K> operator*(const TriangularMatrix<T, N, Uplo>& A, const Matrix<T, N, K>& matrix) {
+    Matrix<T, N, K> m;
+    std::fill(m.begin(), m.end(), T(0));
+    const auto& kernels = dispatch::kernels<T>();
+    for (size_t n = 0; n < N; n++) {
+      const T* row = A.row_data(n);
+      const size_t first = A.row_first(n);
+      for (size_t pos = first; pos <= A.row_last(n); pos++)
+        kernels.axpy(row[pos - first], matrix.data() + pos * K, m.data() + n * K, K);
+    }
+    return m;
+  }
+
+  // Band matrix with KL subdiagonals and KU superdiagonals. Every row
+  // keeps KL + KU + 1 elements: (n, m) is at n * (KL + KU + 1) + m - n + KL.
+  template<typename T, size_t N, size_t KL, size_t KU>
+  class BandedMatrix {
+    static constexpr size_t width = KL + KU + 1;
+    std::vector<T> band;
+
+    static size_t index(size_t n, size_t m) {
+      return n * width + m + KL - n;
+    }
+    static bool in_band(size_t n, size_t m) {
+      return m + KL >= n && m <= n + KU;
+    }
+  public:
+    static constexpr size_t get_storage_size() {
+      return N * width;
+    }
+
+    // Columns of the band in row n
+    static size_t row_first(size_t n) {
+      return n > KL ? n - KL : 0;
+    }
+    static size_t row_last(size_t n) {
+      return std::min(N - 1, n + KU);
+    }
+    const T* row_data(size_t n) const {
+      return band.data() + index(n, row_first(n));
+    }
+
+    BandedMatrix() : band(get_storage_size()) {}
+
+    // Elements outside of the band are ignored
+    template<typename Layout>
+    BandedMatrix(const Matrix<T, N, N, Layout>& matrix) : band(get_storage_size()) {
+      for (size_t n = 0; n < N; n++)
+        for (size_t m = row_first(n); m <= row_last(n); m++)
+          band[index(n, m)] = matrix.get(n, m);
+    }
+
+    T get(size_t n, size_t m) const {
+      assert(n < N && m < N && "Out of the boundaries");
+      return in_band(n, m) ? band[index(n, m)] : T(0);
+    }
+
+    void set(size_t n, size_t m, const T& value) {
+      assert(n < N && m < N && "Out of the boundaries");
+      assert(in_band(n, m) && "Element is outside of the band");
+      band[index(n, m)] = value;
+    }
+
+    Matrix<T, N, N> to_matrix() const {
+      Matrix<T, N, N> matrix;
+      for (size_t n = 0; n < N; n++)
+        for (size_t m = 0; m < N; m++)
+          matrix.set(n, m, get(n, m));
+      return matrix;
+    }
+
+    // y = A * x
+    void apply(const Matrix<T, N, 1>& x, Matrix<T, N, 1>& y) const {
+      const auto& kernels = dispatch::kernels<T>();
+      for (size_t n = 0; n < N; n++) {
+        const size_t first = row_first(n);
+        y[n] = kernels.dot(band.data() + index(n, first), x.data() + first,
+          row_last(n) - first + 1);
+      }
+    }
+
+    // Banded LU with partial pivoting. Row swaps widen the upper band
+    // of U to KL + KU, so elimination works on rows of 2 * KL + KU + 1.
+    long double det() const {
+      typedef detail::det_type det_type;
+      const size_t lu_width = 2 * KL + KU + 1;
+      std::vector<det_type> lu(N * lu_width, det_type(0));
+      auto at = [&lu, lu_width](size_t n, size_t m) -> det_type& {
+        return lu[n * lu_width + m + KL - n];
+      };
+      for (size_t n = 0; n < N; n++)
+        for (size_t m = row_first(n); m <= row_last(n); m++)
+          at(n, m) = static_cast<det_type>(band[index(n, m)]);
+
+      det_type det = 1;
+      for (size_t k = 0; k < N; k++) {
+        const size_t last_row = std::min(N - 1, k + KL);
+        const size_t last_col = std::min(N - 1, k + KL + KU);
+
+        // Search for abs_max element in column below diagonal
+        size_t pivot = k;
+        for (size_t n = k + 1; n <= last_row; n++) {
+          if (std::abs(at(n, k)) > std::abs(at(pivot, k)))
+            pivot = n;
+        }
+        if (at(pivot, k) == 0)
+          return 0;
+        if (pivot != k) {
+          for (size_t m = k; m <= last_col; m++)
+            std::swap(at(k, m), at(pivot, m));
+          det = -det;
+        }
+        det *= at(k, k);
+
+        for (size_t n = k + 1; n <= last_row; n++) {
+          const det_type factor = at(n, k) / at(k, k);
+          for (size_t m = k + 1; m <= last_col; m++)
+            at(n, m) -= factor * at(k, m);
+        }
+      }
+      return static_cast<long double>(det);
+    }
+  };
+
+  template<typename T, size_t N, size_t K, size_t KL, size_t KU>
+  Matrix<T, N, K> operator*(const BandedMatrix<T, N, KL, KU>& A, const Matrix<T, N, K>& matrix) {
+    Matrix<T, N, K> m;
+    std::fill(m.begin(), m.end(), T(0));
+    const auto& kernels = dispatch::kernels<T>();
+    for (size_t n = 0; n < N; n++) {
+      const T* row = A.row_data(n);
+      const size_t first = A.row_first(n);
+      for (size_t pos = first; pos <= A.row_last(n); pos++)
+        kernels.axpy(row[pos - first], matrix.data() + pos * K, m.data() + n * K, K);
+    }
+    return m;
+  }
+}
@@ -7,6 +7,10 @@
 #include <vector>
 
 #include "Matrix.h"
+#include "Solvers.h"
+#include "Distributed.h"
+#include "LowPrecision.h"
+#include "Structured.h"
 
 using namespace std;
 using namespace sm;
@@ -95,6 +99,23 @@ Matrix<float, N, M> gen_random_matrix(float LO, float HI) {
   return matrix;
 }
 
+template<size_t N>
+Matrix<double, N, N> gen_spd_matrix() {
+  Matrix<double, N, N> B = gen_random_matrix<N, N>(-0.5f, 0.5f);
+  Matrix<double, N, N> A = get_transp(B) * B;
+  for (size_t i = 0; i < N; i++)
+    A[i * N + i] += N;
+  return A;
+}
+
+template<typename T, size_t N>
+bool almost_equal_vectors(const Vector<T, N>& x, const Vector<T, N>& y, double acc) {
+  for (size_t i = 0; i < N; i++)
+    if (abs(x[i] - y[i]) > acc)
+      return false;
+  return true;
+}
+
 template<typename T, size_t N, size_t M>
 Matrix<T, N, M> gen_unit_matrix() {
   Matrix<T, N, M> matrix;
@@ -361,6 +382,378 @@ int main(int argc, char** argv)
     CHECK(true, "CHECK LARGE DIFF SIZE MATRIX MULT");
   }
 
+  // Iterative solvers: solve A * x = b for known x
+  {
+    const size_t N = 200;
+    auto A = gen_spd_matrix<N>();
+    Vector<double, N> x_true = gen_random_matrix<N, 1>(-1.f, 1.f);
+    Vector<double, N> b = A * x_true;
+    Vector<double, N> x;
+    fill(x.begin(), x.end(), 0.);
+    auto report = cg(A, b, x);
+    CHECK(report.converged && almost_equal_vectors(x, x_true, 1e-6), "CHECK CG SOLVER",
+      "iterations =", report.iterations, "residual =", report.residual);
+  }
+  {
+    const size_t N = 200;
+    auto A = gen_spd_matrix<N>();
+    Vector<double, N> x_true = gen_random_matrix<N, 1>(-1.f, 1.f);
+    Vector<double, N> b = A * x_true;
+    Vector<double, N> x;
+    fill(x.begin(), x.end(), 0.);
+    auto report1 = cg(A, b, x, SolverParams(), JacobiPreconditioner<double, N>(A));
+    // Warm start from the found solution must converge immediately
+    auto report2 = cg(A, b, x, SolverParams(), ILU0Preconditioner<double, N>(A));
+    CHECK(report1.converged && report2.converged && report2.iterations == 0
+      && almost_equal_vectors(x, x_true, 1e-6), "CHECK PRECONDITIONED CG WARM START",
+      "iterations =", report1.iterations, report2.iterations);
+  }
+  {
+    const size_t N = 200;
+    Matrix<double, N, N> A = gen_random_matrix<N, N>(-0.5f, 0.5f);
+    for (size_t i = 0; i < N; i++)
+      A[i * N + i] += N / 4;
+    Vector<double, N> x_true = gen_random_matrix<N, 1>(-1.f, 1.f);
+    Vector<double, N> b = A * x_true;
+    Vector<double, N> x;
+    fill(x.begin(), x.end(), 0.);
+    auto report = bicgstab(A, b, x, SolverParams(), JacobiPreconditioner<double, N>(A));
+    CHECK(report.converged && almost_equal_vectors(x, x_true, 1e-6), "CHECK BICGSTAB SOLVER",
+      "iterations =", report.iterations, "residual =", report.residual);
+  }
+  {
+    const size_t N = 200;
+    Matrix<double, N, N> A = gen_random_matrix<N, N>(-0.5f, 0.5f);
+    for (size_t i = 0; i < N; i++)
+      A[i * N + i] += N / 4;
+    Vector<double, N> x_true = gen_random_matrix<N, 1>(-1.f, 1.f);
+    Vector<double, N> b = A * x_true;
+    Vector<double, N> x;
+    fill(x.begin(), x.end(), 0.);
+    SolverParams params;
+    params.restart = 3;
+    // Monitor is called once for the initial residual and once per iteration
+    size_t monitor_calls = 0;
+    params.monitor = [&monitor_calls](size_t, double) { monitor_calls++; };
+    auto report = gmres(A, b, x, params, JacobiPreconditioner<double, N>(A));
+    CHECK(report.converged && report.iterations > params.restart
+      && monitor_calls == report.iterations + 1 && almost_equal_vectors(x, x_true, 1e-6),
+      "CHECK RESTARTED GMRES SOLVER",
+      "iterations =", report.iterations, "residual =", report.residual, "monitor =", monitor_calls);
+  }
+  {
+    const size_t N = 100;
+    auto A = gen_spd_matrix<N>();
+    Matrix<double, N, N, ColumnMajor> A_col = A;
+    Matrix<double, N, N, Tiled<16>> A_tiled = A;
+    Vector<double, N> x_true = gen_random_matrix<N, 1>(-1.f, 1.f);
+    Vector<double, N> b = A * x_true;
+    Vector<double, N> x_col, x_tiled;
+    fill(x_col.begin(), x_col.end(), 0.);
+    fill(x_tiled.begin(), x_tiled.end(), 0.);
+    auto report_col = cg(A_col, b, x_col);
+    auto report_tiled = cg(A_tiled, b, x_tiled);
+    CHECK(report_col.converged && report_tiled.converged
+      && almost_equal_vectors(x_col, x_true, 1e-6) && almost_equal_vectors(x_tiled, x_true, 1e-6),
+      "CHECK CG SOLVER (COLUMN-MAJOR AND TILED)");
+  }
+
+#ifdef SM_HAS_SHM_TRANSPORT
+  // SUMMA multiplication in local processes must match in-process multiplication
+  {
+    auto A = gen_random_matrix<int, 120, 90>(10);
+    auto B = gen_random_matrix<int, 90, 60>(10);
+    Matrix<int, 120, 60> C;
+    bool success = run_processes(6, [&A, &B, &C](Transport& transport) {
+      summa_mult<2, 3>(A, B, C, transport);
+    }, 4096);
+    CHECK(success && C == A * B, "CHECK SUMMA MATRIX MULT (2x3 GRID)");
+  }
+  {
+    auto A = gen_random_matrix<100, 80>(-0.5f, 0.5f);
+    auto B = gen_random_matrix<80, 100>(-0.5f, 0.5f);
+    Matrix<float, 100, 100> C;
+    bool success = run_processes(4, [&A, &B, &C](Transport& transport) {
+      summa_mult<2, 2>(A, B, C, transport);
+    });
+    auto C_local = A * B;
+    bool res = true;
+    for (size_t i = 0; i < C.get_size(); i++)
+      res = res && abs(C[i] - C_local[i]) < 1e-4;
+    CHECK(success && res, "CHECK SUMMA MATRIX MULT (2x2 GRID)");
+  }
+  // Failed worker must abort ranks waiting for it instead of hanging
+  {
+    bool success = run_processes(3, [](Transport& transport) {
+      if (transport.rank() == 1)
+        throw std::runtime_error("Worker failed");
+      int value = 0;
+      transport.recv(1, &value, sizeof(value));
+    });
+    CHECK(!success, "CHECK RUN PROCESSES WORKER FAILURE");
+  }
+#endif
+
+  // Reduced precision storage
+  {
+    float values[] = { 0.f, 1.f, -2.5f, 65504.f, 6.1035156e-05f, 5.9604645e-08f, 0.333251953f };
+    bool res = true;
+    for (float value : values)
+      res = res && static_cast<float>(Float16(value)) == value;
+    res = res && std::isinf(static_cast<float>(Float16(70000.f)));
+    res = res && Float16(1.f).get_bits() == 0x3c00 && BFloat16(1.f).get_bits() == 0x3f80;
+    res = res && static_cast<float>(BFloat16(-3.f)) == -3.f;
+    CHECK(res, "CHECK FP16 BF16 CONVERSION");
+  }
+  {
+    auto A = gen_random_matrix<64, 48>(-1.f, 1.f);
+    auto B = gen_random_matrix<48, 32>(-1.f, 1.f);
+    Matrix<BFloat16, 64, 48> A_bf16 = A;
+    Matrix<BFloat16, 48, 32> B_bf16 = B;
+    Matrix<Float16, 64, 48> A_fp16 = A;
+    Matrix<Float16, 48, 32> B_fp16 = B;
+    auto C = A * B;
+    auto C_bf16 = A_bf16 * B_bf16;
+    auto C_fp16 = A_fp16 * B_fp16;
+    bool res = sizeof(BFloat16) == 2 && sizeof(Float16) == 2;
+    for (size_t i = 0; i < C.get_size(); i++)
+      res = res && abs(C[i] - C_bf16[i]) < 0.1f && abs(C[i] - C_fp16[i]) < 0.01f;
+    CHECK(res, "CHECK BF16 FP16 MATRIX MULT");
+  }
+  {
+    // Widening kernels of every level must match scalar conversion on
+    // every 16-bit pattern, NaN payloads included
+    std::vector<uint16_t> bits(1 << 16);
+    iota(bits.begin(), bits.end(), 0);
+    std::vector<float> bf16(bits.size()), fp16(bits.size());
+    bool res = true;
+    for (int level = 0; level <= static_cast<int>(dispatch::detected_isa()); level++) {
+      dispatch::set_isa(static_cast<dispatch::Isa>(level));
+      dispatch::half_kernels().bf16_to_float(bits.data(), bf16.data(), bits.size());
+      dispatch::half_kernels().fp16_to_float(bits.data(), fp16.data(), bits.size());
+      for (size_t i = 0; i < bits.size(); i++) {
+        BFloat16 bf16_ref;
+        Float16 fp16_ref;
+        std::memcpy(&bf16_ref, &bits[i], sizeof(uint16_t));
+        std::memcpy(&fp16_ref, &bits[i], sizeof(uint16_t));
+        float bf16_value = bf16_ref, fp16_value = fp16_ref;
+        res = res && std::memcmp(&bf16[i], &bf16_value, sizeof(float)) == 0
+          && std::memcmp(&fp16[i], &fp16_value, sizeof(float)) == 0;
+      }
+    }
+    dispatch::set_isa(dispatch::detected_isa());
+    CHECK(res, "CHECK BF16 FP16 WIDENING KERNELS");
+  }
+  {
+    Matrix<BFloat16, 3, 2> A = gen_random_matrix<3, 2>(-1.f, 1.f);
+    Matrix<Float16, 3, 2> B = gen_random_matrix<3, 2>(-1.f, 1.f);
+    auto A_sum = A + A;
+    auto B_diff = B - B;
+    auto A_tr = get_transp(A);
+    bool res = true;
+    for (size_t n = 0; n < 3; n++) {
+      for (size_t m = 0; m < 2; m++) {
+        res = res && static_cast<float>(A_sum.get(n, m)) == 2 * static_cast<float>(A.get(n, m))
+          && static_cast<float>(B_diff.get(n, m)) == 0
+          && A_tr.get(m, n).get_bits() == A.get(n, m).get_bits();
+      }
+    }
+    CHECK(res, "CHECK BF16 FP16 ELEMENT-WISE AND TRANSP");
+  }
+  {
+    Matrix<float, 3, 70> A;
+    Matrix<float, 70, 2> B;
+    generate(A.begin(), A.end(), []() { return static_cast<float>(rand() % 255 - 127); });
+    generate(B.begin(), B.end(), []() { return static_cast<float>(rand() % 255 - 127); });
+    A.set(0, 0, 127.f);
+    A.set(1, 0, 127.f);
+    A.set(2, 0, 127.f);
+    B.set(0, 0, 127.f);
+    B.set(0, 1, 127.f);
+    QuantizedMatrix<3, 70, QuantAxis::rows> A_q = A;
+    QuantizedMatrix<70, 2, QuantAxis::columns> B_q = B;
+    Matrix<int, 3, 70> A_int = A;
+    Matrix<int, 70, 2> B_int = B;
+    Matrix<int, 3, 2> C = A_int * B_int;
+    CHECK(A_q.dequantize() == A && quantized_mult(A_q, B_q) == C, "CHECK INT8 GEMM EXACT");
+  }
+  {
+    auto A = gen_random_matrix<100, 300>(-1.f, 1.f);
+    auto B = gen_random_matrix<300, 50>(-1.f, 1.f);
+    auto C = A * B;
+    auto C_q = QuantizedMatrix<100, 300, QuantAxis::rows>(A)
+      * QuantizedMatrix<300, 50, QuantAxis::columns>(B);
+    float max_err = 0;
+    for (size_t i = 0; i < C.get_size(); i++)
+      max_err = max(max_err, abs(C[i] - C_q[i]));
+    CHECK(max_err < 0.3f, "CHECK INT8 QUANTIZED MATRIX MULT", "max error =", max_err);
+  }
+
+  // Every instruction set level must give the same results as plain loops
+  {
+    auto A = gen_random_matrix<67, 45>(-1.f, 1.f);
+    auto B = gen_random_matrix<45, 33>(-1.f, 1.f);
+    Matrix<double, 45, 45> D = gen_random_matrix<45, 45>(-1.f, 1.f);
+    QuantizedMatrix<67, 45, QuantAxis::rows> A_q(A);
+    QuantizedMatrix<45, 33, QuantAxis::columns> B_q(B);
+    dispatch::set_isa(dispatch::Isa::scalar);
+    auto C_ref = A * B;
+    auto C_q_ref = quantized_mult(A_q, B_q);
+    auto sum_ref = (A - A * 2.f).sum();
+    auto tr_ref = get_transp(D);
+    auto tr_float_ref = get_transp(A);
+    auto det_ref = D.det();
+    bool res = true;
+    for (int level = 1; level <= static_cast<int>(dispatch::detected_isa()); level++) {
+      auto isa = dispatch::set_isa(static_cast<dispatch::Isa>(level));
+      auto C = A * B;
+      for (size_t i = 0; i < C.get_size(); i++)
+        res = res && abs(C[i] - C_ref[i]) < 1e-4;
+      res = res && almost_equal((A - A * 2.f).sum(), sum_ref, 1e-4);
+      res = res && get_transp(D) == tr_ref && get_transp(A) == tr_float_ref;
+      res = res && almost_equal(D.det(), det_ref, 1e-9);
+      res = res && quantized_mult(A_q, B_q) == C_q_ref;
+      if (!res) {
+        cout << "failed on " << dispatch::isa_name(isa) << endl;
+        break;
+      }
+    }
+    dispatch::set_isa(dispatch::detected_isa());
+    CHECK(res, "CHECK CPU DISPATCH LEVELS", "detected =",
+      dispatch::isa_name(dispatch::detected_isa()));
+  }
+
+  // Storage layouts
+  {
+    Matrix<int, 3, 5> matrix = gen_random_matrix<int, 3, 5>(100);
+    Matrix<int, 3, 5, ColumnMajor> col_matrix = matrix;
+    Matrix<int, 3, 5, Tiled<2>> tiled_matrix = matrix;
+    bool res = col_matrix.data()[1] == matrix.get(1, 0)
+      && tiled_matrix.data()[2] == matrix.get(1, 0)
+      && tiled_matrix.get_storage_size() == 24;
+    for (size_t n = 0; n < 3; n++)
+      for (size_t m = 0; m < 5; m++)
+        res = res && col_matrix.get(n, m) == matrix.get(n, m)
+          && tiled_matrix.get(n, m) == matrix.get(n, m);
+    res = res && equal(matrix.begin(), matrix.end(), col_matrix.begin())
+      && equal(matrix.begin(), matrix.end(), tiled_matrix.begin())
+      && Matrix<int, 3, 5>(tiled_matrix) == matrix;
+    CHECK(res, "CHECK LAYOUT ACCESS AND CONVERSION");
+  }
+  {
+    Matrix<int, 4, 7> matrix = gen_random_matrix<int, 4, 7>(100);
+    Matrix<int, 4, 7> copy = matrix;
+    const int* buffer = matrix.data();
+    auto tr_matrix = relabel_transp(move(matrix));
+    Matrix<int, 4, 7, ColumnMajor> col_matrix = copy;
+    Matrix<int, 4, 7, Tiled<3>> tiled_matrix = copy;
+    auto tr_tiled = get_transp(tiled_matrix);
+    bool res = tr_matrix.data() == buffer && matrix.data() == nullptr
+      && Matrix<int, 7, 4>(tr_matrix) == get_transp(copy)
+      && Matrix<int, 7, 4>(get_transp(col_matrix)) == get_transp(copy)
+      && Matrix<int, 7, 4>(tr_tiled) == get_transp(copy)
+      && Matrix<int, 4, 7>(relabel_transp(move(tr_tiled))) == copy;
+    CHECK(res, "CHECK LAYOUT TRANSP");
+  }
+  {
+    auto A = gen_random_matrix<int, 37, 29>(10);
+    auto B = gen_random_matrix<int, 29, 41>(10);
+    auto C = A * B;
+    Matrix<int, 37, 29, Tiled<8>> A_tiled = A;
+    Matrix<int, 29, 41, Tiled<8>> B_tiled = B;
+    Matrix<int, 29, 41, ColumnMajor> B_col = B;
+    Matrix<int, 37, 29, ColumnMajor> A_col = A;
+    bool res = C == A * B_col && C == A_col * B_col
+      && C == Matrix<int, 37, 41>(A_tiled * B_tiled);
+    auto D = A_tiled + A_tiled;
+    res = res && Matrix<int, 37, 29>(D) == A + A && D.sum() == 2 * A.sum();
+    CHECK(res, "CHECK LAYOUT MATRIX MULT");
+  }
+  {
+    auto A = gen_random_matrix<48, 48>(-0.5f, 0.5f);
+    Matrix<float, 48, 48, Tiled<16>> A_tiled = A;
+    Matrix<float, 48, 48, ColumnMajor> A_col = A;
+    auto det = A.det();
+    CHECK(almost_equal(A_tiled.det(), det, 1e-9) && almost_equal(A_col.det(), det, 1e-9),
+      "CHECK LAYOUT DET");
+  }
+
+  // Structured matrixes must agree with dense ones
+  {
+    const size_t N = 60;
+    auto dense = gen_spd_matrix<N>();
+    SymmetricMatrix<double, N> A = dense;
+    auto B = Matrix<double, N, 7>(gen_random_matrix<N, 7>(-1.f, 1.f));
+    Vector<double, N> x = gen_random_matrix<N, 1>(-1.f, 1.f);
+    Vector<double, N> y, x_found;
+    A.apply(x, y);
+    auto C = A * B;
+    auto C_dense = dense * B;
+    auto y_dense = dense * x;
+    bool res = A.to_matrix() == dense && A.get_storage_size() == N * (N + 1) / 2;
+    for (size_t i = 0; i < C.get_size(); i++)
+      res = res && abs(C[i] - C_dense[i]) < 1e-9;
+    for (size_t i = 0; i < N; i++)
+      res = res && abs(y[i] - y_dense[i]) < 1e-9;
+    fill(x_found.begin(), x_found.end(), 0.);
+    res = res && cg(A, y, x_found).converged && almost_equal_vectors(x_found, x, 1e-6);
+    CHECK(res, "CHECK SYMMETRIC PACKED MATRIX");
+  }
+  {
+    const size_t N = 50;
+    Matrix<double, N, N> dense = gen_random_matrix<N, N>(-0.5f, 0.5f);
+    for (size_t i = 0; i < N; i++)
+      dense[i * N + i] += 2;
+    TriangularMatrix<double, N, Triangle::lower> L = dense;
+    TriangularMatrix<double, N, Triangle::upper> U = dense;
+    auto B = Matrix<double, N, 5>(gen_random_matrix<N, 5>(-1.f, 1.f));
+    auto L_dense = L.to_matrix();
+    auto U_dense = U.to_matrix();
+    bool res = L_dense.get(3, 2) == dense.get(3, 2) && L_dense.get(2, 3) == 0
+      && U_dense.get(2, 3) == dense.get(2, 3) && U_dense.get(3, 2) == 0;
+    auto LB = L * B;
+    auto UB = U * B;
+    auto LB_dense = L_dense * B;
+    auto UB_dense = U_dense * B;
+    auto X_L = L.solve(LB);
+    auto X_U = U.solve(UB);
+    for (size_t i = 0; i < B.get_size(); i++) {
+      res = res && abs(LB[i] - LB_dense[i]) < 1e-9 && abs(UB[i] - UB_dense[i]) < 1e-9;
+      res = res && abs(X_L[i] - B[i]) < 1e-9 && abs(X_U[i] - B[i]) < 1e-9;
+    }
+    Vector<double, N> x = gen_random_matrix<N, 1>(-1.f, 1.f);
+    Vector<double, N> y;
+    U.apply(x, y);
+    auto y_dense = U_dense * x;
+    for (size_t i = 0; i < N; i++)
+      res = res && abs(y[i] - y_dense[i]) < 1e-9;
+    res = res && almost_equal(L.det(), L_dense.det(), 1e-9)
+      && almost_equal(U.det(), U_dense.det(), 1e-9);
+    CHECK(res, "CHECK TRIANGULAR PACKED MATRIX");
+  }
+  {
+    const size_t N = 80;
+    Matrix<double, N, N> dense = gen_random_matrix<N, N>(-1.f, 1.f);
+    BandedMatrix<double, N, 2, 3> A = dense;
+    auto A_dense = A.to_matrix();
+    bool res = A_dense.get(10, 8) == dense.get(10, 8) && A_dense.get(10, 7) == 0
+      && A_dense.get(10, 13) == dense.get(10, 13) && A_dense.get(10, 14) == 0
+      && A.get_storage_size() == N * 6;
+    auto B = Matrix<double, N, 4>(gen_random_matrix<N, 4>(-1.f, 1.f));
+    auto C = A * B;
+    auto C_dense = A_dense * B;
+    for (size_t i = 0; i < C.get_size(); i++)
+      res = res && abs(C[i] - C_dense[i]) < 1e-9;
+    Vector<double, N> x = gen_random_matrix<N, 1>(-1.f, 1.f);
+    Vector<double, N> y;
+    A.apply(x, y);
+    auto y_dense = A_dense * x;
+    for (size_t i = 0; i < N; i++)
+      res = res && abs(y[i] - y_dense[i]) < 1e-9;
+    CHECK(res && almost_equal(A.det(), A_dense.det(), 1e-6), "CHECK BANDED MATRIX",
+      "det =", A.det(), "dense det =", A_dense.det());
+  }
+
   cout << "END TESTING" << endl;
 
   getchar();